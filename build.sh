@@ -3,7 +3,20 @@
 # Build a bootable cdrom image
 mkdir -p ./isodir/boot/grub
 cp ./src/LostOS.bin ./isodir/boot/
-echo 'menuentry "LostOS" {
-        multiboot /boot/LostOS.bin
-    }' > isodir/boot/grub/grub.cfg
-grub-mkrescue -o LostOS.iso isodir
\ No newline at end of file
+
+# Every file in ./modules goes in the image as a multiboot module, mapped in place by the kernel (see src/kernel/mm/modules.c)
+entry='menuentry "LostOS" {
+        multiboot /boot/LostOS.bin'
+if [ -d ./modules ]; then
+    mkdir -p ./isodir/boot/modules
+    for f in ./modules/*; do
+        [ -f "$f" ] || continue
+        cp "$f" ./isodir/boot/modules/
+        entry="$entry
+        module /boot/modules/$(basename "$f")"
+    done
+fi
+
+echo "$entry
+    }" > isodir/boot/grub/grub.cfg
+grub-mkrescue -o LostOS.iso isodir
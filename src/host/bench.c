@@ -0,0 +1,919 @@
+/**
+ * \brief Hosted benchmark of the memory managers.
+ * 
+ * pmm.c (+ its backend), kheap.c, slab.c, vregion.c and common/string.c are compiled for the Linux host and linked with this file,
+ * which plays the part of the rest of the kernel:
+ *      - a simulated GRUB memory map (HOST_RAM of RAM, with the usual hole below 1MB)
+ *      - the linker symbols 'start' and 'end', with a big arena after 'end' for the PMM metadata and the heap
+ *      - a fake VMM that keeps a page table for the arena and takes the frames from the PMM
+ *        (the pages allocated anywhere, as the slabs are, come from the end of the arena)
+ *      - lazy reservations (vReserveLazy()) protected with mprotect(), so the first touch of a page is a real fault
+ *      - a shadow of the simulated RAM, so the frames zeroed for PMM_ZERO really get zeroed (and can be checked)
+ * 
+ * Every workload runs in its own process, so a crash of the kernel code is reported instead of killing the bench.
+ * The exit code is not 0 if a workload crashed or found a corrupted allocation.
+ * 
+ * Build and run it with (PMM_BACKEND works as for the kernel):
+ * \code
+ * make host-bench
+ * \endcode
+ */
+
+#include <mm/pmm.h>
+#include <mm/vmm.h>
+#include <mm/kheap.h>
+#include <mm/slab.h>
+#include <mm/vregion.h>
+
+#include <common/string.h>
+
+// system.h has its own
+#undef EOF
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#define HOST_RAM (128 * M)              ///< RAM of the simulated machine
+#define HOST_ARENA (512 * M)            ///< Virtual space after 'end' (PMM metadata + heap)
+#define HOST_ANYWHERE (384 * M)         ///< Where the pages allocated anywhere are (past the heap)
+#define HOST_PD_PHYS 0x101000           ///< Where the boot page directory would be
+
+#define DEFAULT_OPS 200000              ///< Operations for each workload
+#define MAX_LIVE 4096                   ///< Live allocations kept by a workload
+#define KHEAP_VERIFY_EVERY 4096         ///< kmalloc/kfree operations between two walks of the heap
+#define KREALLOC_BUFFERS 16             ///< Growable buffers of the krealloc workload
+#define KREALLOC_MAX 65536              ///< Size a buffer of the krealloc workload starts over from
+
+#define VREGION_BENCH_BASE 0xD0000000    ///< Virtual space of the allocVRegion workload
+#define VREGION_BENCH_PAGES 16384
+
+/**
+ * The kernel symbols. The arena is in the .bss of a non-PIE executable,
+ * so its addresses fit in the uint32_t the kernel code uses for pointers.
+ */
+char hostStart[PAGE_SIZE] __asm__("start") __attribute__((aligned(PAGE_SIZE)));
+char hostArena[HOST_ARENA] __asm__("end") __attribute__((aligned(PAGE_SIZE)));
+
+char hostRAM[HOST_RAM] __attribute__((aligned(PAGE_SIZE)));    ///< What vMapTemp() shows of a frame
+
+uint32_t hostPageTable[HOST_ARENA / PAGE_SIZE];    ///< Fake PTEs of the arena (0 = not present)
+uint32_t hostMappedPages;                           ///< Pages mapped right now
+uint32_t hostPeakMappedPages;                       ///< Highest hostMappedPages
+
+uint32_t hostLazyStart, hostLazyPages, hostLazyFlags;   ///< The range reserved with vReserveLazy() (just one)
+uint32_t hostFaults;                                    ///< Pages mapped on their first touch
+
+/**
+ * A live allocation of a workload.
+ */
+typedef struct allocation {
+    uint32_t addr;
+    uint32_t size;
+} allocation_t;
+
+allocation_t live[MAX_LIVE];
+uint32_t nLive;
+
+uint64_t *latencies;                ///< Nanoseconds of each operation
+uint32_t nLatencies;
+
+/* Interrupts: nothing to do on the host. */
+uint32_t interrupt_save_disable() {
+    return 0;
+}
+
+void interrupt_restore(uint32_t eflags) {
+    (void)eflags;
+}
+
+/* Used by the zeroing of the PMM: the same rep stosd as the kernel. */
+void *memsetl(void *dest, int32_t c, size_t n) {
+    __asm__ volatile("cld; rep stosl"
+        : "+D"(dest), "+c"(n)
+        : "a"(c)
+        : "flags", "memory");
+    return dest;
+}
+
+/**
+ * Fake VMM: only the arena can be mapped, the memory is already there.
+ * The PTE is kept just to drop the reference to the frame on unmap (like vmm.c does) and to count the pages.
+ */
+uint32_t *hostPTE(void *virt) {
+    uint32_t v = (uint32_t)(uintptr_t)virt;
+    uint32_t base = (uint32_t)(uintptr_t)hostArena;
+
+    if (v < base || v - base >= HOST_ARENA || (v & (PAGE_SIZE - 1)))
+        return NULL;
+    return &hostPageTable[(v - base) / PAGE_SIZE];
+}
+
+bool vMapPage(void *phys, void *virt, uint32_t flags) {
+    uint32_t *pte = hostPTE(virt);
+
+    if (!pte || (*pte & BIT_PD_PT_PRESENT))
+        return false;
+
+    *pte = ((uint32_t)(uintptr_t)phys & ~0xFFF) | flags | BIT_PD_PT_PRESENT;
+    if (++hostMappedPages > hostPeakMappedPages)
+        hostPeakMappedPages = hostMappedPages;
+    return true;
+}
+
+bool vUnmapPage(void *virt) {
+    uint32_t *pte = hostPTE(virt);
+
+    if (!pte || !(*pte & BIT_PD_PT_PRESENT))
+        return false;
+
+    page_t *page = pGetPage((void *)(uintptr_t)(*pte & ~0xFFF));
+    if (page && (page->flags & PAGE_USED))
+        pFreePage((void *)(uintptr_t)(*pte & ~0xFFF));
+    *pte = 0;
+    hostMappedPages--;
+    return true;
+}
+
+/**
+ * The pages of the lazy reservation are protected again, so touching them faults like in the kernel.
+ */
+bool vUnmapRange(void *virt, uint32_t n) {
+    uint32_t i, v = (uint32_t)(uintptr_t)virt;
+    bool unmapped = false;
+
+    for (i = 0; i < n; i++)
+        unmapped |= vUnmapPage((char *)virt + i * PAGE_SIZE);
+    if (hostLazyPages && v >= hostLazyStart && (v - hostLazyStart) / PAGE_SIZE < hostLazyPages)
+        mprotect(virt, n * PAGE_SIZE, PROT_NONE);
+    return unmapped;
+}
+
+void *vMapTemp(void *phys) {
+    return &hostRAM[(uint32_t)(uintptr_t)phys & ~0xFFF];
+}
+
+void vUnmapTemp() {
+}
+
+void *vAllocPage(void *virt, uint32_t flags, bool man) {
+    (void)man;
+    uint32_t phys = pAllocPage();
+
+    if (!phys)
+        return NULL;
+    if (!vMapPage((void *)(uintptr_t)phys, virt, flags)) {
+        pFreePage((void *)(uintptr_t)phys);
+        return NULL;
+    }
+    return virt;
+}
+
+/**
+ * Find n unmapped pages in a row for an allocation anywhere (what allocVRegion() does in the kernel).
+ * The search goes on from where the last one stopped, so it's short when the pages come and go one at a time.
+ */
+void *hostAnywhere(uint32_t n) {
+    static uint32_t next = HOST_ANYWHERE / PAGE_SIZE;
+    uint32_t pages = HOST_ARENA / PAGE_SIZE;
+    uint32_t tries, run = 0;
+
+    for (tries = 0; tries < pages - HOST_ANYWHERE / PAGE_SIZE; tries++) {
+        if (next >= pages) {
+            next = HOST_ANYWHERE / PAGE_SIZE;
+            run = 0;
+        }
+        run = (hostPageTable[next++] & BIT_PD_PT_PRESENT) ? 0 : run + 1;
+        if (run == n)
+            return hostArena + (next - n) * PAGE_SIZE;
+    }
+    return NULL;
+}
+
+void *vAllocPages(void *virt, uint32_t flags, uint32_t n, bool man) {
+    uint32_t i;
+
+    if (!virt && !(virt = hostAnywhere(n)))
+        return NULL;
+
+    for (i = 0; i < n; i++) {
+        void *page = (char *)virt + i * PAGE_SIZE;
+        if (!vAllocPage(page, flags, man)) {
+            while (i-- > 0)
+                vUnmapPage((char *)virt + i * PAGE_SIZE);
+            return NULL;
+        }
+    }
+    return virt;
+}
+
+void vFreePages(void *virt, uint32_t n) {
+    uint32_t i;
+
+    for (i = 0; i < n; i++)
+        vUnmapPage((char *)virt + i * PAGE_SIZE);
+}
+
+/**
+ * SIGSEGV in the arena: what vHandleFault() does on a page fault. 
+ * A zeroed frame is mapped to the page, which becomes accessible, and the instruction runs again.
+ * Any other fault puts back the default action, so it crashes the workload when it runs again.
+ */
+void hostFaultHandler(int sig, siginfo_t *info, void *context) {
+    (void)context;
+    uint32_t v = (uint32_t)(uintptr_t)info->si_addr & ~0xFFF;
+
+    if (hostLazyPages && v >= hostLazyStart && (v - hostLazyStart) / PAGE_SIZE < hostLazyPages) {
+        uint32_t phys = pAllocPageFlags(PMM_ZONE_ANY | PMM_ZERO);
+        if (phys && vMapPage((void *)(uintptr_t)phys, (void *)(uintptr_t)v, hostLazyFlags)) {
+            mprotect((void *)(uintptr_t)v, PAGE_SIZE, PROT_READ | PROT_WRITE);
+            memset((void *)(uintptr_t)v, 0, PAGE_SIZE);
+            hostFaults++;
+            return;
+        }
+        if (phys)
+            pFreePage((void *)(uintptr_t)phys);
+    }
+    signal(sig, SIG_DFL);
+}
+
+/**
+ * Fake lazy reservation: the heap part of the arena (after the PMM metadata), with no access until a page is touched.
+ */
+void *vReserveLazy(void *virt, uint32_t flags, uint32_t n, bool man) {
+    (void)man;
+    uint32_t start = virt ? (uint32_t)(uintptr_t)virt : roundPageAligned((uint32_t)(uintptr_t)hostArena + _pmmMetadataSize);
+
+    if (hostLazyPages || !hostPTE((void *)(uintptr_t)start) || !hostPTE((void *)(uintptr_t)(start + (n - 1) * PAGE_SIZE)))
+        return NULL;
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = hostFaultHandler;
+    action.sa_flags = SA_SIGINFO;
+    sigaction(SIGSEGV, &action, NULL);
+    mprotect((void *)(uintptr_t)start, n * PAGE_SIZE, PROT_NONE);
+
+    hostLazyStart = start;
+    hostLazyPages = n;
+    hostLazyFlags = flags;
+    return (void *)(uintptr_t)start;
+}
+
+/* The metadata is in the arena, which is all there already. */
+bool vMapBoot(void *virt, uint32_t size) {
+    (void)virt;
+    (void)size;
+    return true;
+}
+
+bool vNameRegion(void *virt, uint32_t n, const char *name) {
+    (void)virt;
+    (void)n;
+    (void)name;
+    return true;
+}
+
+/**
+ * Build the multiboot structure GRUB would give for HOST_RAM and start the PMM.
+ */
+void hostBoot() {
+    static memory_map_t mmap[3];
+    static multiboot_info_t mbt;
+    uint32_t i;
+
+    mmap[0].base_addr_low = 0;
+    mmap[0].length_low = 0x9FC00;
+    mmap[0].type = 1;
+    mmap[1].base_addr_low = 0x9FC00;
+    mmap[1].length_low = 0x100000 - 0x9FC00;
+    mmap[1].type = 2;
+    mmap[2].base_addr_low = 0x100000;
+    mmap[2].length_low = HOST_RAM - 0x100000;
+    mmap[2].type = 1;
+    for (i = 0; i < 3; i++)
+        mmap[i].size = sizeof(memory_map_t) - sizeof(mmap[i].size);
+
+    mbt.flags = 0x1 | 0x20 | 0x40;
+    mbt.mem_lower = 0x9FC00 / 1024;
+    mbt.mem_upper = (HOST_RAM - 0x100000) / 1024;
+    mbt.mmap_addr = (uint32_t)(uintptr_t)mmap;
+    mbt.mmap_length = sizeof(mmap);
+
+    init_pmm(&mbt, (uint32_t *)HOST_PD_PHYS);
+}
+
+/**
+ * xorshift32, so every run (and every backend) sees the same workload.
+ */
+uint32_t rng = 0x12345678;
+
+uint32_t hostRandom() {
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng;
+}
+
+uint64_t now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int compareLatencies(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Print ops/sec and the percentiles of the latencies of a workload.
+ */
+void report(const char *name, uint64_t elapsed) {
+    qsort(latencies, nLatencies, sizeof(uint64_t), compareLatencies);
+
+    printf("%-24s %10.0f ops/s   p50 %6lu ns   p99 %6lu ns   max %8lu ns\n", name,
+           nLatencies / (elapsed / 1e9),
+           (unsigned long)latencies[nLatencies / 2],
+           (unsigned long)latencies[(nLatencies * 99) / 100],
+           (unsigned long)latencies[nLatencies - 1]);
+}
+
+/**
+ * Write a pattern in a heap allocation, so an overlap is found when it's freed.
+ * (Physical memory isn't mapped on the host, the PMM is checked with hostFrames instead)
+ */
+void fill(allocation_t *a) {
+    memset((void *)(uintptr_t)a->addr, (uint8_t)a->addr, a->size);
+}
+
+bool check(allocation_t *a) {
+    uint32_t i;
+
+    for (i = 0; i < a->size; i++)
+        if (((uint8_t *)(uintptr_t)a->addr)[i] != (uint8_t)a->addr)
+            return false;
+    return true;
+}
+
+uint8_t hostFrames[HOST_RAM / PAGE_SIZE];     ///< Frames held by the workload (to find duplicates)
+
+/**
+ * Measure how scattered the free physical memory is.
+ * All the free frames are taken one by one (and given back) to know exactly which ones are free.
+ * 
+ * @param total Free pages.
+ * @param largestRun Longest run of contiguous free pages.
+ * @param largestAlloc Biggest pAllocPages() that succeeds (the backend may have a limit).
+ */
+void pmmFragmentation(uint32_t *total, uint32_t *largestRun, uint32_t *largestAlloc) {
+    static uint8_t isFree[HOST_RAM / PAGE_SIZE];
+    static uint32_t frames[HOST_RAM / PAGE_SIZE];
+    uint32_t i, run = 0;
+    uint32_t lo = 0, hi = HOST_RAM / PAGE_SIZE;
+
+    drainCachesPMM();
+
+    *total = 0;
+    while ((frames[*total] = pAllocPage()) != 0)
+        (*total)++;
+    memset(isFree, 0, sizeof(isFree));
+    for (i = 0; i < *total; i++) {
+        isFree[frames[i] / PAGE_SIZE] = 1;
+        pFreePage((void *)(uintptr_t)frames[i]);
+    }
+    drainCachesPMM();
+
+    *largestRun = 0;
+    for (i = 0; i < HOST_RAM / PAGE_SIZE; i++) {
+        run = isFree[i] ? run + 1 : 0;
+        if (run > *largestRun)
+            *largestRun = run;
+    }
+
+    while (lo < hi) {
+        uint32_t mid = (lo + hi + 1) / 2;
+        uint32_t addr = pAllocPages(mid * PAGE_SIZE);
+        if (addr) {
+            pFreePages((void *)(uintptr_t)addr, mid * PAGE_SIZE);
+            lo = mid;
+        } else
+            hi = mid - 1;
+    }
+    *largestAlloc = lo;
+}
+
+/**
+ * Random alloc/free of physical memory.
+ * 
+ * @param maxPages 1 for pAllocPage/pFreePage, otherwise pAllocPages/pFreePages of 1..maxPages pages.
+ * @param ops Number of operations.
+ * @return If every allocation was valid.
+ */
+bool benchPMM(uint32_t maxPages, uint32_t ops) {
+    uint32_t i, j;
+    uint64_t start = now();
+
+    for (i = 0; i < ops; i++) {
+        bool alloc = nLive == 0 || (nLive < MAX_LIVE && (hostRandom() & 1));
+        uint64_t t0, t1;
+
+        if (alloc) {
+            allocation_t a;
+            a.size = (maxPages == 1 ? 1 : 1 + hostRandom() % maxPages) * PAGE_SIZE;
+
+            t0 = now();
+            a.addr = (maxPages == 1) ? pAllocPage() : pAllocPages(a.size);
+            t1 = now();
+
+            if (!a.addr)
+                continue;
+            for (j = 0; j < a.size / PAGE_SIZE; j++) {
+                uint32_t frame = a.addr / PAGE_SIZE + j;
+                if (frame < 0x100000 / PAGE_SIZE || frame >= HOST_RAM / PAGE_SIZE || hostFrames[frame]) {
+                    printf("frame 0x%x given twice or out of RAM\n", frame * PAGE_SIZE);
+                    return false;
+                }
+                hostFrames[frame] = 1;
+            }
+            live[nLive++] = a;
+        } else {
+            uint32_t k = hostRandom() % nLive;
+            allocation_t a = live[k];
+            live[k] = live[--nLive];
+
+            for (j = 0; j < a.size / PAGE_SIZE; j++)
+                hostFrames[a.addr / PAGE_SIZE + j] = 0;
+
+            t0 = now();
+            if (maxPages == 1)
+                pFreePage((void *)(uintptr_t)a.addr);
+            else
+                pFreePages((void *)(uintptr_t)a.addr, a.size);
+            t1 = now();
+        }
+        latencies[nLatencies++] = t1 - t0;
+    }
+
+    report(maxPages == 1 ? "pAllocPage/pFreePage" : "pAllocPages/pFreePages", now() - start);
+
+    uint32_t total, largestRun, largestAlloc;
+    pmmFragmentation(&total, &largestRun, &largestAlloc);
+    printf("%-24s %u live, %u pages free, largest free run %u pages (%u%% fragmented), largest pAllocPages %u pages\n", "",
+           nLive, total, largestRun, total ? 100 - (largestRun * 100) / total : 0, largestAlloc);
+    printf("%-24s metadata %u KiB + %u bytes of per-CPU caches, %u contiguous failures with enough free pages\n", "",
+           _pmmMetadataSize / 1024, (uint32_t)(sizeof(pmm_cache_t) * PMM_CPUS), _contiguousFailures);
+    return true;
+}
+
+/**
+ * Random pAllocPageFlags(PMM_ZERO)/pFreePage, with the idle loop running zeroIdlePMM() every 64 operations.
+ * Every page is dirtied after the check, so a frame that comes back without being zeroed is caught.
+ */
+bool benchZero(uint32_t ops) {
+    uint32_t i, j;
+    uint32_t idleZeroed = 0;
+    uint64_t start = now();
+
+    for (i = 0; i < ops; i++) {
+        bool alloc = nLive == 0 || (nLive < MAX_LIVE && (hostRandom() & 1));
+        uint64_t t0, t1;
+
+        if (i % 64 == 0) {
+            // The idle loop, between two bursts of work (not timed)
+            for (j = 0; j < 16 && zeroIdlePMM(); j++)
+                idleZeroed++;
+        }
+
+        if (alloc) {
+            allocation_t a;
+            a.size = PAGE_SIZE;
+
+            t0 = now();
+            a.addr = pAllocPageFlags(PMM_ZONE_ANY | PMM_ZERO);
+            t1 = now();
+
+            if (!a.addr)
+                continue;
+            uint32_t *words = (uint32_t *)&hostRAM[a.addr];
+            for (j = 0; j < PAGE_SIZE / sizeof(uint32_t); j++) {
+                if (words[j] != 0) {
+                    printf("frame 0x%x isn't zeroed\n", a.addr);
+                    return false;
+                }
+            }
+            memset(words, 0xAA, PAGE_SIZE);
+            live[nLive++] = a;
+        } else {
+            uint32_t k = hostRandom() % nLive;
+            allocation_t a = live[k];
+            live[k] = live[--nLive];
+
+            t0 = now();
+            pFreePage((void *)(uintptr_t)a.addr);
+            t1 = now();
+        }
+        latencies[nLatencies++] = t1 - t0;
+    }
+
+    report("pAllocPageFlags(ZERO)", now() - start);
+    printf("%-24s %u frames zeroed by the idle loop, %u zeroed on the spot\n", "", idleZeroed, _zeroPoolMisses);
+    return true;
+}
+
+uint32_t vregionPages;      ///< Pages the allocVRegion workload's allocator took for its nodes
+
+/**
+ * Where the allocator of the allocVRegion workload gets more nodes (like kernelSpacePage() in the kernel).
+ */
+void *vregionPage() {
+    vregionPages++;
+    return vAllocPages(NULL, BIT_PD_PT_PRESENT | BIT_PD_PT_RW, 1, false);
+}
+
+/**
+ * Random allocVRegion/freeVRegion of 1..16 pages in 64MB of virtual space.
+ * 
+ * Then the nodes run out: every page is taken one at a time and every other one is given back, 
+ * so there are many more free ranges than VREGION_NODES. None can be lost, and freeing the rest must merge them back into one.
+ */
+bool benchVRegion(uint32_t ops) {
+    static vregion_t space;
+    static uint8_t used[VREGION_BENCH_PAGES];
+    uint32_t i, j, failures = 0;
+    uint64_t start = now();
+
+    initVRegion(&space, VREGION_BENCH_BASE, VREGION_BENCH_BASE + VREGION_BENCH_PAGES * PAGE_SIZE, vregionPage);
+    for (i = 0; i < ops; i++) {
+        bool alloc = nLive == 0 || (nLive < MAX_LIVE && (hostRandom() & 1));
+        uint64_t t0, t1;
+
+        if (alloc) {
+            allocation_t a;
+            a.size = 1 + hostRandom() % 16;
+
+            t0 = now();
+            a.addr = allocVRegion(&space, a.size);
+            t1 = now();
+
+            if (!a.addr) {
+                failures++;
+                continue;
+            }
+            for (j = 0; j < a.size; j++) {
+                uint32_t page = (a.addr - VREGION_BENCH_BASE) / PAGE_SIZE + j;
+                if (page >= VREGION_BENCH_PAGES || used[page]) {
+                    printf("virtual 0x%x given twice or out of the space\n", a.addr + j * PAGE_SIZE);
+                    return false;
+                }
+                used[page] = 1;
+            }
+            live[nLive++] = a;
+        } else {
+            uint32_t k = hostRandom() % nLive;
+            allocation_t a = live[k];
+            live[k] = live[--nLive];
+
+            for (j = 0; j < a.size; j++)
+                used[(a.addr - VREGION_BENCH_BASE) / PAGE_SIZE + j] = 0;
+
+            t0 = now();
+            bool ok = freeVRegion(&space, a.addr, a.size);
+            t1 = now();
+
+            if (!ok)
+                return false;
+        }
+        latencies[nLatencies++] = t1 - t0;
+    }
+
+    report("allocVRegion/freeVRegion", now() - start);
+    printf("%-24s %u live ranges, %u allocations failed\n", "", nLive, failures);
+
+    // Out of nodes
+    while (nLive > 0) {
+        allocation_t a = live[--nLive];
+        if (!freeVRegion(&space, a.addr, a.size))
+            return false;
+    }
+    for (i = 0; i < VREGION_BENCH_PAGES; i++)
+        if (allocVRegion(&space, 1) != VREGION_BENCH_BASE + i * PAGE_SIZE) {
+            printf("page %u of the virtual space isn't the next one free\n", i);
+            return false;
+        }
+    for (i = 0; i < VREGION_BENCH_PAGES; i += 2)
+        if (!freeVRegion(&space, VREGION_BENCH_BASE + i * PAGE_SIZE, 1))
+            return false;
+    for (i = 1; i < VREGION_BENCH_PAGES; i += 2)
+        if (!freeVRegion(&space, VREGION_BENCH_BASE + i * PAGE_SIZE, 1))
+            return false;
+    if (allocVRegion(&space, VREGION_BENCH_PAGES) != VREGION_BENCH_BASE) {
+        printf("the virtual space isn't one free range again\n");
+        return false;
+    }
+    printf("%-24s %u free ranges at most, %u pages of nodes\n", "", VREGION_BENCH_PAGES / 2, vregionPages);
+    return true;
+}
+
+/**
+ * Random kmalloc/kfree, sizes biased towards small objects.
+ * The heap is walked with kheapVerify() every KHEAP_VERIFY_EVERY operations (not timed).
+ */
+bool benchKheap(uint32_t ops) {
+    uint32_t i;
+    uint32_t liveBytes = 0, peakLiveBytes = 0;
+    uint64_t start = now();
+
+    init_kheap();
+    for (i = 0; i < ops; i++) {
+        bool alloc = nLive == 0 || (nLive < MAX_LIVE && (hostRandom() & 1));
+        uint64_t t0, t1;
+
+        if (alloc) {
+            allocation_t a;
+            uint32_t r = hostRandom();
+            a.size = (r & 3) ? 8 + (r >> 8) % 256 : 8 + (r >> 8) % 8192;
+
+            t0 = now();
+            a.addr = (uint32_t)(uintptr_t)kmalloc(a.size);
+            t1 = now();
+
+            if (!a.addr)
+                continue;
+            if (!hostPTE((void *)(uintptr_t)(a.addr & ~0xFFF))) {
+                printf("kmalloc returned 0x%x, outside the heap\n", a.addr);
+                return false;
+            }
+            fill(&a);
+            live[nLive++] = a;
+            liveBytes += a.size;
+            if (liveBytes > peakLiveBytes)
+                peakLiveBytes = liveBytes;
+        } else {
+            uint32_t k = hostRandom() % nLive;
+            allocation_t a = live[k];
+            live[k] = live[--nLive];
+            liveBytes -= a.size;
+
+            if (!check(&a)) {
+                printf("allocation at 0x%x (%u bytes) was overwritten\n", a.addr, a.size);
+                return false;
+            }
+
+            t0 = now();
+            kfree((void *)(uintptr_t)a.addr);
+            t1 = now();
+        }
+        latencies[nLatencies++] = t1 - t0;
+
+        if ((i % KHEAP_VERIFY_EVERY) == KHEAP_VERIFY_EVERY - 1 && !kheapVerify())
+            return false;
+    }
+    if (!kheapVerify())
+        return false;
+
+    report("kmalloc/kfree", now() - start);
+    printf("%-24s peak %u KiB live, peak %u KiB mapped (%u KiB overhead), %u pages mapped on first touch\n", "",
+           peakLiveBytes / 1024, hostPeakMappedPages * 4,
+           hostPeakMappedPages * 4 - peakLiveBytes / 1024, hostFaults);
+
+    // Everything goes, then what the idle loop would give back
+    while (nLive > 0)
+        kfree((void *)(uintptr_t)live[--nLive].addr);
+    uint32_t mapped = hostMappedPages;
+    while (kheapTrimIdle())
+        ;
+    if (!kheapVerify())
+        return false;
+    printf("%-24s %u KiB given back by trimming (%u KiB when idle), %u KiB still mapped\n", "",
+           _kheapReclaimed / 1024, (mapped - hostMappedPages) * 4, hostMappedPages * 4);
+
+    // The empty heap is a single free block, trimmed to about KHEAP_TRIM_KEEP: that much must stay mapped
+    if (hostMappedPages * PAGE_SIZE < KHEAP_TRIM_KEEP || hostMappedPages * PAGE_SIZE > KHEAP_TRIM_KEEP + 2 * PAGE_SIZE) {
+        printf("%u KiB of the empty heap are mapped, not about %u KiB\n", hostMappedPages * 4, KHEAP_TRIM_KEEP / 1024);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Growable buffers: KREALLOC_BUFFERS of them, each grown by half its size (or sometimes cut to a quarter) with krealloc(), 
+ * between small kmalloc/kfree that get in the way. The content must survive, wherever the buffer ends up.
+ */
+bool benchKrealloc(uint32_t ops) {
+    allocation_t buffers[KREALLOC_BUFFERS];
+    uint32_t i, j, moved = 0;
+    uint64_t start = now();
+
+    init_kheap();
+    for (i = 0; i < KREALLOC_BUFFERS; i++) {
+        buffers[i].size = 16;
+        buffers[i].addr = (uint32_t)(uintptr_t)kmalloc(16);
+        fill(&buffers[i]);
+    }
+
+    for (i = 0; i < ops; i++) {
+        uint32_t r = hostRandom();
+
+        if ((r & 3) == 0) {
+            // Something small in the way
+            if (nLive < MAX_LIVE && (nLive == 0 || (r & 4))) {
+                allocation_t a = { (uint32_t)(uintptr_t)kmalloc(16 + (r >> 8) % 128), 0 };
+                if (a.addr)
+                    live[nLive++] = a;
+            } else
+                kfree((void *)(uintptr_t)live[--nLive].addr);
+            continue;
+        }
+
+        allocation_t *b = &buffers[(r >> 2) % KREALLOC_BUFFERS];
+        uint32_t size = (r & 0xF0) == 0 ? b->size / 4 + 16 : b->size + b->size / 2;
+        if (size > KREALLOC_MAX)
+            size = 16;
+
+        uint64_t t0 = now();
+        uint32_t addr = (uint32_t)(uintptr_t)krealloc((void *)(uintptr_t)b->addr, size);
+        uint64_t t1 = now();
+
+        if (!addr)
+            continue;
+        for (j = 0; j < b->size && j < size; j++)
+            if (((uint8_t *)(uintptr_t)addr)[j] != (uint8_t)b->addr) {
+                printf("krealloc lost the content of 0x%x (%u -> %u bytes)\n", b->addr, b->size, size);
+                return false;
+            }
+        if (addr != b->addr)
+            moved++;
+        b->addr = addr;
+        b->size = size;
+        fill(b);
+        latencies[nLatencies++] = t1 - t0;
+    }
+    if (!kheapVerify())
+        return false;
+
+    report("krealloc", now() - start);
+    printf("%-24s %u of %u resizes copied the buffer\n", "", moved, nLatencies);
+    return true;
+}
+
+/**
+ * Random kmem_cache_alloc/kmem_cache_free from three caches of small objects (the hot ones of the kernel).
+ */
+bool benchSlab(uint32_t ops) {
+    static const uint32_t sizes[] = { 24, 64, 200 };
+    kmem_cache_t *caches[3];
+    uint32_t i, liveBytes = 0, peakLiveBytes = 0;
+    uint64_t start = now();
+
+    for (i = 0; i < 3; i++)
+        caches[i] = kmem_cache_create("bench", sizes[i], 0);
+
+    for (i = 0; i < ops; i++) {
+        bool alloc = nLive == 0 || (nLive < MAX_LIVE && (hostRandom() & 1));
+        uint64_t t0, t1;
+
+        if (alloc) {
+            allocation_t a;
+            uint32_t c = hostRandom() % 3;
+            a.size = sizes[c];
+
+            t0 = now();
+            a.addr = (uint32_t)(uintptr_t)kmem_cache_alloc(caches[c]);
+            t1 = now();
+
+            if (!a.addr)
+                continue;
+            if (!hostPTE((void *)(uintptr_t)(a.addr & ~0xFFF))) {
+                printf("kmem_cache_alloc returned 0x%x, outside the arena\n", a.addr);
+                return false;
+            }
+            fill(&a);
+            live[nLive++] = a;
+            liveBytes += a.size;
+            if (liveBytes > peakLiveBytes)
+                peakLiveBytes = liveBytes;
+        } else {
+            uint32_t k = hostRandom() % nLive;
+            allocation_t a = live[k];
+            live[k] = live[--nLive];
+            liveBytes -= a.size;
+
+            if (!check(&a)) {
+                printf("object at 0x%x (%u bytes) was overwritten\n", a.addr, a.size);
+                return false;
+            }
+
+            kmem_cache_t *cache = caches[a.size == sizes[0] ? 0 : (a.size == sizes[1] ? 1 : 2)];
+            t0 = now();
+            kmem_cache_free(cache, (void *)(uintptr_t)a.addr);
+            t1 = now();
+        }
+        latencies[nLatencies++] = t1 - t0;
+    }
+
+    report("kmem_cache_alloc/free", now() - start);
+    printf("%-24s peak %u KiB live, peak %u KiB mapped, %u slabs left\n", "",
+           peakLiveBytes / 1024, hostPeakMappedPages * 4,
+           caches[0]->slabs + caches[1]->slabs + caches[2]->slabs);
+    return true;
+}
+
+/**
+ * itoa/utoa, as used by printf().
+ */
+bool benchString(uint32_t ops) {
+    char buffer[32];
+    uint32_t i;
+    uint64_t start = now();
+
+    for (i = 0; i < ops; i++) {
+        uint32_t n = hostRandom();
+        uint64_t t0 = now();
+        utoa(n, buffer, (i & 1) ? 16 : 10);
+        uint64_t t1 = now();
+
+        if (strtoul(buffer, NULL, (i & 1) ? 16 : 10) != n) {
+            printf("utoa(%u) gave %s\n", n, buffer);
+            return false;
+        }
+        latencies[nLatencies++] = t1 - t0;
+    }
+
+    report("utoa", now() - start);
+    return true;
+}
+
+/**
+ * Run a workload in a child process, on a freshly booted PMM.
+ * 
+ * @return If it finished without crashing and without errors.
+ */
+bool run(const char *name, int workload, uint32_t ops) {
+    fflush(stdout);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        bool ok = true;
+
+        // The PMM prints its initialization only for the first run
+        int out = dup(STDOUT_FILENO);
+        if (workload >= 0)
+            freopen("/dev/null", "w", stdout);
+        hostBoot();
+        fflush(stdout);
+        dup2(out, STDOUT_FILENO);
+        latencies = calloc(ops, sizeof(uint64_t));
+
+        switch (workload) {
+            case 0: ok = benchPMM(1, ops); break;
+            case 1: ok = benchPMM(64, ops); break;
+            case 2: ok = benchKheap(ops); break;
+            case 3: ok = benchString(ops); break;
+            case 4: ok = benchZero(ops); break;
+            case 5: ok = benchVRegion(ops); break;
+            case 6: ok = benchSlab(ops); break;
+            case 7: ok = benchKrealloc(ops); break;
+        }
+        fflush(stdout);
+        _exit(ok ? 0 : 1);
+    }
+
+    int status;
+    waitpid(pid, &status, 0);
+    if (WIFSIGNALED(status)) {
+        printf("%-24s CRASHED (signal %d)\n", name, WTERMSIG(status));
+        return false;
+    }
+    if (WEXITSTATUS(status) != 0) {
+        printf("%-24s FAILED\n", name);
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    uint32_t ops = argc > 1 ? strtoul(argv[1], NULL, 0) : DEFAULT_OPS;
+    bool ok = true;
+
+    printf("LostOS memory managers, %u ops per workload, %u MiB of simulated RAM\n\n", ops, HOST_RAM / M);
+
+    ok &= run("init", -1, 1);
+    printf("\n");
+
+    ok &= run("pAllocPage/pFreePage", 0, ops);
+    ok &= run("pAllocPages/pFreePages", 1, ops);
+    ok &= run("pAllocPageFlags(ZERO)", 4, ops);
+    ok &= run("allocVRegion/freeVRegion", 5, ops);
+    ok &= run("kmalloc/kfree", 2, ops);
+    ok &= run("krealloc", 7, ops);
+    ok &= run("kmem_cache_alloc/free", 6, ops);
+    ok &= run("utoa", 3, ops);
+
+    return ok ? 0 : 1;
+}
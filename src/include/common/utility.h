@@ -6,6 +6,7 @@
 
 void *memset(void *dest, int32_t c, size_t n);
 void *memsetw(void *dest, int32_t c, size_t n);
+void *memsetl(void *dest, int32_t c, size_t n);
 void *memcpy(void *dest, const void *src, size_t n);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,27 @@
+#ifndef IDLE_H
+#define IDLE_H
+
+#include <system.h>
+
+#define IDLE_MAX_WORK 8         ///< Idle work functions that can be registered
+#define IDLE_BUDGET_TICKS 1     ///< Ticks of idle work before halting (and looking at the interrupts)
+
+#define IDLE_BUSY 0             ///< The CPU is doing real work
+#define IDLE_WORKING 1          ///< The CPU is doing idle work
+#define IDLE_HALTED 2           ///< The CPU is halted, waiting for an interrupt
+
+/**
+ * Deferrable work for when there is nothing else to do (e.g. zeroing free frames).
+ * It must do a small piece of it and return, true if it did something (so it could have more to do).
+ */
+typedef bool (*idle_work_t)();
+
+extern uint32_t _idleTicks;         ///< Ticks that found the CPU halted
+extern uint32_t _idleWorkTicks;     ///< Ticks that found the CPU doing idle work
+extern uint32_t _busyTicks;         ///< Ticks that found the CPU busy
+
+bool idle_addWork(const char *name, idle_work_t work);
+void idle_tick();
+void idle_loop();
+
+#endif
@@ -37,5 +37,6 @@ extern void isr31();
 
 void isrs_init();
 void faultHandler(regs_t *r);
+void isr_doubleFault();
 
 #endif
\ No newline at end of file
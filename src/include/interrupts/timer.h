@@ -3,6 +3,8 @@
 
 #include <system.h>
 
+extern volatile uint32_t tick;      ///< Ticks since init_clock()
+
 void init_clock(uint32_t frequency);
 void tickHandler(regs_t *r);
 
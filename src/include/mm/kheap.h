@@ -4,19 +4,26 @@
 #include <system.h>
 
 #define KHEAP_LENGTH 0x10000000       ///< The maximum length of the heap - 256MB
+#define KHEAP_CLASSES 17              ///< Size classes of the free blocks (16, 24, 32, 48, 64... 3072, 4096 bytes)
+#define KHEAP_MIN_BLOCK 16            ///< Bytes of the smallest class
+#define KHEAP_MAX_SMALL 4096          ///< Bytes of the biggest class: anything bigger gets pages of its own
+#define KHEAP_USED 1                  ///< Bit of the size of a block, set while it's allocated
+#define KHEAP_TRIMMED 2               ///< Bit of the size of a free block, set once its whole pages were given back
+#define KHEAP_FLAGS 7                 ///< Bits of the size that aren't the size (blocks are multiples of 8 bytes)
+#define KHEAP_TRIM_THRESHOLD 0x40000  ///< A free block this big at the end of the heap is trimmed right away by kfree() - 256KB
+#define KHEAP_TRIM_KEEP 0x10000       ///< Bytes of the free block at the end that stay mapped, for the next allocations - 64KB
+#define KHEAP_TRIM_MIN 0x4000         ///< Whole pages a free block in the middle must have to be trimmed (when idle) - 16KB
+#define KHEAP_MAGIC 0x4B484550        ///< In the header of every block ("KHEP"), to catch frees of what kmalloc() didn't give
 
 /**
- * This structure represent a block inside the linked list of the heap. 
- * (It really is only a contiguous block of memory)
- * It is based in the header of the chunk.
+ * This structure is the header of a block of the heap, right before the memory kmalloc() gives.
  * Thus, when returned, it is important to remember to add sizeof(kheapHeader);
  * and when a pointer is received, subtract it.
+ * The last 4 bytes of the block (its footer) are its size again, so the block before a block is found from there.
  */
 typedef struct _kheapHeader {
-    struct _kheapHeader *prev;      ///< Previous block in the chunk
-    struct _kheapHeader *next;      ///< Next block of the chunk 
-
-    uint32_t size;                   ///< Size of the chunk minus the size of this header
+    uint32_t size;                   ///< Size of the whole block, header and footer included (KHEAP_USED while allocated)
+    uint32_t magic;                  ///< KHEAP_MAGIC
 } kheapHeader;
 
 void init_kheap();
@@ -27,4 +34,11 @@ void *krealloc(void *ptr, uint32_t newSize);
 
 void *kfree(void *addr);
 
-#endif
\ No newline at end of file
+bool kheapVerify();
+
+uint32_t kheapTrim();
+bool kheapTrimIdle();
+
+extern uint32_t _kheapReclaimed;
+
+#endif
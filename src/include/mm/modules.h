@@ -0,0 +1,29 @@
+#ifndef MODULES_H
+#define MODULES_H
+
+#include <multiboot.h>
+#include <system.h>
+
+#define MODULES_MAX 16          ///< Modules the kernel keeps track of (the others are left alone)
+#define MODULE_NAME 32          ///< Longest name of a module (with the terminator)
+
+/**
+ * A module GRUB loaded next to the kernel (a 'module' line in grub.cfg).
+ * It stays where GRUB put it: the PMM never gives its frames away, and the VMM maps them read-only.
+ */
+typedef struct boot_module {
+    uint32_t phys;              ///< Physical address of the first byte
+    uint32_t size;              ///< Bytes
+    const uint8_t *data;        ///< Where it's mapped (null until mapModules())
+    char name[MODULE_NAME];     ///< Last part of the path in its command line
+} boot_module_t;
+
+extern boot_module_t _modules[MODULES_MAX];
+extern uint32_t _nModules;
+
+void init_modules(multiboot_info_t *mbt);
+void mapModules();
+
+boot_module_t *findModule(const char *name);
+
+#endif
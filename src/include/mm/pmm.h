@@ -7,23 +7,100 @@
 
 #define PAGE_SIZE 0x1000
 
+/**
+ * Physical memory zones.
+ * ISA DMA can only reach the first 16MB, and the memory above 896MB is "high" memory.
+ */
+#define ZONE_DMA 0                  ///< 0 - 16MB
+#define ZONE_NORMAL 1               ///< 16MB - 896MB
+#define ZONE_HIGH 2                 ///< 896MB - 4GB
+#define PMM_ZONES 3
+
+#define PMM_DMA_LIMIT 0x01000000    ///< End of ZONE_DMA
+#define PMM_NORMAL_LIMIT 0x38000000 ///< End of ZONE_NORMAL
+
+/**
+ * Zone masks, for the allocation functions that take flags.
+ * When more zones are allowed they are tried in this order: normal, high, DMA (the scarcest is the last resort).
+ */
+#define PMM_ZONE_DMA (1 << ZONE_DMA)
+#define PMM_ZONE_NORMAL (1 << ZONE_NORMAL)
+#define PMM_ZONE_HIGH (1 << ZONE_HIGH)
+#define PMM_ZONE_ANY (PMM_ZONE_DMA | PMM_ZONE_NORMAL | PMM_ZONE_HIGH)
+
+#define PMM_ZERO 0x100              ///< Flag: the frames must be zeroed (taken from the pre-zeroed pool if possible)
+
+#define PMM_CPUS 1                  ///< Number of per-CPU frame caches
+#define PMM_CACHE_SIZE 64           ///< Frames in a per-CPU cache
+#define PMM_CACHE_BATCH 32          ///< Frames moved at once between a cache and the backend
+
+#define PMM_ZERO_POOL 64            ///< Pre-zeroed frames kept for PMM_ZERO, filled by the idle loop
+
+#define PAGE_USED 0x1               ///< Allocated (refcount is the number of users)
+#define PAGE_RESERVED 0x2           ///< Never given to the PMM (kernel, BIOS, holes in the memory map)
+#define PAGE_FREE_BLOCK 0x4         ///< First frame of a block in a free list of the backend (buddy)
+
+#define PAGE_OWNER_NONE 0           ///< Free or reserved
+#define PAGE_OWNER_KERNEL 1         ///< Allocated with pAllocPage() or pAllocPages()
+#define PAGE_OWNER_PAGE_TABLE 2     ///< Page table or page directory
+#define PAGE_OWNER_HEAP 3           ///< Kernel heap
+#define PAGE_OWNER_USER 4           ///< Mapped in user space
+
+/**
+ * Descriptor of a physical frame, one for each frame the PMM keeps track of (_pages[frame]).
+ * 
+ * The allocation gives the first reference: the frame goes back to the PMM when the last one is dropped with pFreePage().
+ * A mapping owns a reference, so whoever maps a frame a second time (shared memory, copy-on-write) takes another one with pRefPage().
+ * 
+ * It's the only array with an entry for every frame: a backend that needs one (buddy) keeps its free lists here too. 
+ * A free frame has no users, so the links of the free lists share their bytes with refcount and mapped.
+ */
+typedef struct page {
+    uint16_t flags;         ///< PAGE_USED, PAGE_RESERVED, PAGE_FREE_BLOCK
+    uint8_t order;          ///< The allocation (or the free block) starting here is (up to) 2^order frames, 0 for single pages
+    uint8_t owner;          ///< PAGE_OWNER_*
+    union {
+        struct {
+            uint16_t refcount;  ///< Number of users of the frame
+            uint16_t mapped;    ///< If it's a page table: how many of its entries are present (so an empty one is found in O(1))
+        };
+        uint32_t next;          ///< PAGE_FREE_BLOCK: next free block of the same order (frame number)
+    };
+    uint32_t prev;          ///< PAGE_FREE_BLOCK: previous free block of the same order (frame number)
+} page_t;
+
 /** First address then nContiguousPages */
 typedef struct free_mem {
     uint32_t *addr;
     uint32_t nContiguousPages;
 } free_mem_t;
 
-free_mem_t *_stack;
+/**
+ * Per-CPU cache (magazine) of free frames, in front of the backend.
+ * Single page allocations and frees only touch this, with interrupts disabled.
+ */
+typedef struct pmm_cache {
+    uint32_t count;                         ///< Frames in the cache
+    uint32_t frames[PMM_CACHE_SIZE];        ///< The frames (stack, top at count - 1)
+} pmm_cache_t;
 
-extern char start;  ///< Of the kernel      | Linker
-extern char end;    ///< Start of the stack | Symbols
+extern char start;  ///< Of the kernel             | Linker
+extern char end;    ///< Start of the PMM metadata | Symbols
 
 uint32_t _start_addr_phys;
 uint32_t _end_addr_phys;
 
 uint32_t _RAMSize;
+uint32_t _nFrames;          ///< Number of frames the PMM keeps track of
+
+uint32_t _pmmMetadataSize;  ///< Bytes reserved after the kernel for the PMM (backend and page descriptors)
+uint32_t _pmmMetadataStart; ///< Virtual address of the PMM metadata: right after the kernel, or after the modules GRUB put there
+
+page_t *_pages;             ///< Descriptors of the frames, right after the metadata of the backend
 
-uint32_t _halfMaxStack;
+uint32_t _freePages;            ///< Free pages (in the backend and in the per-CPU caches)
+uint32_t _contiguousFailures;   ///< pAllocPages() that failed even if there were enough free pages
+uint32_t _zeroPoolMisses;       ///< PMM_ZERO pages that had to be zeroed on the spot
 
 void init_pmm(multiboot_info_t* mbt, uint32_t *pd);
 
@@ -33,6 +110,15 @@ bool pFreePage(void *addr);
 uint32_t pAllocPages(uint32_t size);
 bool pFreePages(void *addr, uint32_t size);
 
+uint32_t pAllocPageFlags(uint32_t flags);
+uint32_t pAllocPagesFlags(uint32_t size, uint32_t flags);
+
+page_t *pGetPage(void *addr);
+uint32_t pRefPage(void *addr);
+
+void drainCachesPMM();
+bool zeroIdlePMM();
+
 uint32_t roundPageAligned(uint32_t n);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,31 @@
+#ifndef PMM_BACKEND_H
+#define PMM_BACKEND_H
+
+#include <system.h>
+#include <mm/pmm.h>
+
+/**
+ * Interface between the PMM (pmm.c) and the structure that really keeps track of the free frames.
+ * The backend is chosen at build time with PMM_BACKEND in the Makefile (buddy, bitmap or extent).
+ * Everything here is in frames (address / PAGE_SIZE), never in bytes.
+ * 
+ * Each zone is managed on its own: a run passed to freeFramesPMM() never crosses a zone boundary 
+ * and the backend must never merge runs of different zones.
+ */
+
+#define PMM_NO_FRAME 0xFFFFFFFF     ///< Invalid frame, returned when there is no memory
+
+extern const char *pmmBackendName;
+
+extern uint32_t _zoneStart[PMM_ZONES];     ///< First frame of each zone
+extern uint32_t _zoneEnd[PMM_ZONES];       ///< Frame after the last one of each zone
+
+uint32_t zoneOfFrame(uint32_t frame);
+
+uint32_t metadataSizePMM(uint32_t nFrames);
+void initFramesPMM(void *metadata, uint32_t nFrames);
+
+uint32_t allocFramesPMM(uint32_t count, uint32_t zone);
+void freeFramesPMM(uint32_t frame, uint32_t count, uint32_t zone);
+
+#endif
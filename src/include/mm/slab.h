@@ -0,0 +1,47 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <system.h>
+#include <mm/pmm.h>
+
+#define SLAB_CACHES 32                      ///< Caches that can exist at the same time
+#define SLAB_MAX_OBJECT (PAGE_SIZE / 8)     ///< Biggest object of a cache (so a slab has at least 7 of them)
+#define SLAB_MIN_ALIGN 4                    ///< Objects are aligned at least to this (a free one holds a pointer)
+
+struct kmem_cache;
+
+/**
+ * A slab: a page of objects of the same size, with this header at its start.
+ * The free objects make a list through their first word, so an object has no header of its own.
+ */
+typedef struct slab {
+    struct kmem_cache *cache;   ///< Cache the slab belongs to
+    struct slab *prev;          ///< Previous slab in its list
+    struct slab *next;          ///< Next slab in its list
+    void *free;                 ///< First free object (null if the slab is full)
+    uint32_t inUse;             ///< Objects allocated
+} slab_t;
+
+/**
+ * An object cache: the slabs of the objects of one size, in three lists.
+ * Allocations take from a partially used slab first, so the empty ones can go back to the VMM.
+ */
+typedef struct kmem_cache {
+    const char *name;           ///< What the objects are (null if the cache is free)
+    uint32_t size;              ///< Bytes of an object, rounded up to the alignment
+    uint32_t offset;            ///< Where the first object of a slab is (after its header)
+    uint32_t perSlab;           ///< Objects in a slab
+    slab_t *partial;            ///< Slabs with both free and allocated objects
+    slab_t *full;               ///< Slabs with no free objects
+    slab_t *empty;              ///< At most one slab with nothing allocated, kept for the next allocation
+    uint32_t slabs;             ///< Slabs of the cache
+    uint32_t objects;           ///< Objects allocated
+} kmem_cache_t;
+
+kmem_cache_t *kmem_cache_create(const char *name, uint32_t size, uint32_t align);
+bool kmem_cache_destroy(kmem_cache_t *cache);
+
+void *kmem_cache_alloc(kmem_cache_t *cache);
+void kmem_cache_free(kmem_cache_t *cache, void *obj);
+
+#endif
@@ -11,9 +11,31 @@
 #define BIT_PD_PT_ACCESSED  0x00000020 // Frame/table was accessed.
 #define BIT_PD_PT_DIRTY     0x00000040 // Frame/table was modified.
 #define BIT_PD_PAGE_SIZE    0x00000080 // Is a 4MB page frame?
+#define BIT_PD_PT_GLOBAL    0x00000100 // Kept in the TLB across CR3 switches (CR4.PGE)?
+#define BIT_PD_PT_COW       0x00000200 // Shared read-only after a vCloneSpace(), copied on the first write? (available bit)
+
+#define LARGE_PAGE_SIZE 0x400000 // Size of a PSE page (a page directory entry with BIT_PD_PAGE_SIZE)
 
 #define PD_VADDR 0xFFFFF000
 #define PT_BASE_VADDR 0xFFC00000
+#define TEMP_MAP_VADDR 0xFFBFF000 // Window to get to a single frame (see vMapTemp())
+#define TEMP_WINDOWS_VADDR 0xFFBF8000 // Windows on the paging structures of other address spaces (see vmm.c)
+
+#define VMM_FLUSH_PAGES 32 // Unmapping more pages than this reloads CR3 instead of invlpg-ing each one
+
+#define VMM_KERNEL_SPACE_START 0xD0000000 // Kernel virtual addresses given out by vAllocPages()
+#define VMM_KERNEL_SPACE_END 0xFF800000
+
+#define VMM_ADDRESS_SPACES 64 // Address spaces that can exist at the same time
+
+#define VMM_REGIONS 32 // Ranges with a descriptor: lazy (see vReserveLazy()), guarded (see vAllocGuarded()) or just named
+
+#define VMM_GUARD_BELOW 0x1 // The first page of the region is a guard page
+#define VMM_GUARD_ABOVE 0x2 // The last page of the region is a guard page
+
+#define PF_PRESENT 0x1 // Page fault error code: the page was present (a protection fault)
+#define PF_WRITE 0x2   // Page fault error code: it was a write
+#define PF_USER 0x4    // Page fault error code: it happened in user mode
 
 #define PAGE_DIRECTORY_ADDR_OFFSET 22
 #define PAGE_TABLE_ADDR_OFFSET 12
@@ -22,14 +44,60 @@
 #define PAGE_TABLE_INDEX(x) (((x) >> PAGE_TABLE_ADDR_OFFSET) & 0x3ff)
 #define PAGE_GET_PHYSICAL_ADDRESS(x) (*x & ~0xfff)
 
+/**
+ * An address space: a page directory of its own for the user half (below KERNEL_VIRTUAL_BASE), 
+ * while the kernel half is the same page tables in all of them.
+ */
+typedef struct address_space {
+    uint32_t pd;        ///< Physical address of the page directory (0 if the slot is free)
+} address_space_t;
+
+extern char stack_guard;    ///< Guard page below the boot stack | bootloader.asm
+extern char start_stack;    ///< Top of the boot stack           |
+
+extern address_space_t *_kernelAddressSpace;
+extern address_space_t *_currentAddressSpace;
+
 void init_vmm();
 
 bool vMapPage(void *phys, void *virt, uint32_t flags);
 bool vUnmapPage(void *virt);
 
+bool vMapRange(void *phys, void *virt, uint32_t n, uint32_t flags);
+bool vUnmapRange(void *virt, uint32_t n);
+
 void *vAllocPage(void *virt, uint32_t flags, bool man);
 void *vAllocPages(void *virt, uint32_t flags, uint32_t n, bool man);
+void vFreePages(void *virt, uint32_t n);
+void *vMapPhysical(void *phys, uint32_t n, uint32_t flags);
+bool vMapBoot(void *virt, uint32_t size);
+
+void *vReserveLazy(void *virt, uint32_t flags, uint32_t n, bool man);
+bool vNameRegion(void *virt, uint32_t n, const char *name);
+bool vHandleFault(void *addr, uint32_t err);
+
+void *vAllocGuarded(uint32_t flags, uint32_t n, const char *name);
+void vFreeGuarded(void *virt, uint32_t n);
+void *vAllocStack(uint32_t n);
+void vFreeStack(void *top, uint32_t n);
+bool vGuardBelow(void *virt, uint32_t n, const char *name);
+
+void vReportFault(void *addr, uint32_t err);
+void vDescribeAddress(void *addr);
+
+address_space_t *vCreateSpace();
+address_space_t *vCloneSpace(address_space_t *src);
+bool vDestroySpace(address_space_t *space);
+void vSwitchSpace(address_space_t *space);
+bool vMapPageIn(address_space_t *space, void *phys, void *virt, uint32_t flags);
+
+void *vMapTemp(void *phys);
+void vUnmapTemp();
 
 extern void set_cr3(uint32_t *pd_phys_addr);
+extern void paging_invalidate_pte(void *virt);
+extern uint32_t *paging_get_cr3();
+extern void *paging_get_cr2();
+extern void paging_flush_global();
 
 #endif
\ No newline at end of file
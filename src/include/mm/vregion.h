@@ -0,0 +1,48 @@
+#ifndef VREGION_H
+#define VREGION_H
+
+#include <system.h>
+
+#define VREGION_CHUNK_NODES 170 ///< Nodes in a chunk: as many as fit in a page
+#define VREGION_CHUNKS 512      ///< Chunks an allocator can have (the first VREGION_INLINE_CHUNKS are inside it)
+#define VREGION_INLINE_CHUNKS 2 ///< Chunks inside the allocator, before it needs pages of its own
+#define VREGION_NODES (VREGION_INLINE_CHUNKS * VREGION_CHUNK_NODES)   ///< Free ranges an allocator can keep track of without growing
+
+/**
+ * A range of free virtual pages, node of an AVL tree ordered by address.
+ * Every node also knows the biggest range of its subtree, so the search for a free range never looks at more than a path.
+ */
+typedef struct vregion_node {
+    uint32_t start;         ///< First page (address / PAGE_SIZE)
+    uint32_t pages;         ///< Number of pages
+    uint32_t maxPages;      ///< Biggest range in the subtree
+    uint32_t left;          ///< Lower addresses (or next node in the pool, if unused)
+    uint32_t right;         ///< Higher addresses
+    uint32_t height;        ///< Height of the subtree
+} vregion_node_t;
+
+/**
+ * Allocator of the virtual addresses of a part of an address space (e.g. the kernel's).
+ * 
+ * The nodes are in chunks of a page, so the ones in use never move: 
+ * when the pool is empty (a lot of small free ranges) it gets another chunk from newPage.
+ */
+typedef struct vregion {
+    uint32_t start;         ///< First page it manages
+    uint32_t end;           ///< Page after the last one it manages
+    uint32_t root;          ///< Root of the tree (0 = empty)
+    uint32_t pool;          ///< First unused node
+    uint32_t nChunks;       ///< Chunks in chunks[]
+    bool growing;           ///< If it's getting a new chunk (newPage can use the allocator, but can't make it grow again)
+    void *(*newPage)();     ///< Where new chunks come from: a mapped page, or null if there isn't one (null if it can't grow)
+    vregion_node_t *chunks[VREGION_CHUNKS];
+    vregion_node_t nodes[VREGION_NODES];     ///< The first chunks
+} vregion_t;
+
+void initVRegion(vregion_t *r, uint32_t start, uint32_t end, void *(*newPage)());
+
+uint32_t allocVRegion(vregion_t *r, uint32_t pages);
+bool reserveVRegion(vregion_t *r, uint32_t addr, uint32_t pages);
+bool freeVRegion(vregion_t *r, uint32_t addr, uint32_t pages);
+
+#endif
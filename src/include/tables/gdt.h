@@ -5,10 +5,15 @@
 
 /**
  * 2 segments descriptors for kernel mode;
- * 2 segments descriptors for user mode.
+ * 2 segments descriptors for user mode;
+ * 2 TSS (the kernel's and the double fault handler's).
  * + 1 NULL
  */
-#define DESCRIPTORS 5
+#define DESCRIPTORS 7
+
+#define TSS_SELECTOR 0x28                  ///< TSS of the kernel (the task that is running)
+#define TSS_DOUBLE_FAULT_SELECTOR 0x30     ///< TSS of the double fault handler, for its task gate
+#define DOUBLE_FAULT_STACK 4096            ///< Bytes of the stack of the double fault handler
 
 /*** GDT STRUCTURES ***/
 typedef struct gdt_entry {
@@ -30,10 +35,30 @@ typedef struct gdt_descriptor {
     uint32_t offset;
 } __attribute__((packed)) gdt_descriptor_t;
 
+/**
+ * Task State Segment.
+ * There is no hardware multitasking: the kernel's TSS is just where the CPU saves the state of the kernel 
+ * when it switches to the double fault handler, which is a task of its own (with its own stack).
+ */
+typedef struct tss {
+    uint32_t link;
+    uint32_t esp0, ss0, esp1, ss1, esp2, ss2;
+    uint32_t cr3, eip, eflags;
+    uint32_t eax, ecx, edx, ebx, esp, ebp, esi, edi;
+    uint32_t es, cs, ss, ds, fs, gs;
+    uint32_t ldt;
+    uint16_t trap, iomap;
+} __attribute__((packed)) tss_t;
+
+extern tss_t _tss;
+extern tss_t _doubleFaultTSS;
+
 void init_gdt();
+void gdt_setDoubleFault(void (*handler)());
 void gdt_setEntry(int index, uint32_t base, uint64_t limit, uint8_t access, uint8_t flags);
 
 // Defined in gdt_load.asm
 extern void gdt_load(uint32_t gdt_ptr);
+extern void tss_load(uint16_t selector);
 
 #endif
\ No newline at end of file
@@ -11,7 +11,10 @@ PDE_INDEX   equ (KERNEL_VIRTUAL_BASE >> 22)
 
 ; Paging bits
 PSE_BIT     equ 0x00000010
+PGE_BIT     equ 0x00000080
+CPUID_PGE   equ 0x00002000                                ; CPUID.1:EDX, global pages are supported
 PG_BIT      equ 0x80000000
+WP_BIT      equ 0x00010000                                ; CR0, read-only pages are read-only for the kernel too (copy-on-write)
 
 section .lowerhalf.data
 align 4
@@ -32,8 +35,9 @@ BootPageDirectory:
     dd 0x00000083
     times(PDE_INDEX - 1) dd 0
 
-    ; This page directory defines a 4MB page containing the kernel
-    dd 0x00000083
+    ; This page directory defines a 4MB page containing the kernel.
+    ; It's also global (bit 8): the kernel is the same in every address space, so its translation survives CR3 switches.
+    dd 0x00000183
     times(1024 - PDE_INDEX - 1) dd 0
 
 section .lowerhalf.text progbits alloc exec nowrite align=16
@@ -53,9 +57,23 @@ setup:
     or ecx, PSE_BIT
     mov cr4, ecx
 
-    ; Set PG bit in CR0 to enable paging
+    ; Set PGE bit in CR4 to enable global pages, if the CPU has them
+    mov esi, eax
+    mov edi, ebx
+    mov eax, 1
+    cpuid
+    mov eax, esi
+    mov ebx, edi
+    test edx, CPUID_PGE
+    jz .noPGE
+    mov ecx, cr4
+    or ecx, PGE_BIT
+    mov cr4, ecx
+.noPGE:
+
+    ; Set PG bit in CR0 to enable paging (and WP, so the kernel's writes to copy-on-write pages fault as well)
     mov ecx, cr0
-    or ecx, PG_BIT
+    or ecx, PG_BIT | WP_BIT
     mov cr0, ecx
 
     ; Start fetching instructions in kernel space.
@@ -97,7 +115,12 @@ startInHigherHalf:
         jmp l
         
 section .bss nobits
-align 4
+align 4096
+global stack_guard
+global start_stack
+stack_guard:
+    ; Guard page: unmapped by the VMM, so a stack overflow is a fault instead of a corruption of what's below (see vGuardBelow())
+    resb 4096
 end_stack:
     ; 1024 * 1024 * 4 = 104856 (4MB)
     resb 419424
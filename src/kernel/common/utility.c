@@ -46,6 +46,27 @@ void *memsetw(void *dest, int32_t c, size_t n) {
   return dest;
 }
 
+/**
+ * Set 'n' double words in 'dest' as 'c'.
+ * A rep stosd moves 4 bytes at a time, so it's the fastest way to clear whole pages.
+ * 
+ * @param dest Pointer to the destination buffer.
+ * @param c Double word to copy.
+ * @param n Times to copy.
+ * 
+ * @return The destination buffer.
+ */
+void *memsetl(void *dest, int32_t c, size_t n) {
+  void *d = dest;
+
+  asm volatile("cld; rep stosl"
+    : "+D"(d), "+c"(n)
+    : "a"(c)
+    : "flags", "memory");
+
+  return dest;
+}
+
 /**
  * Copy 'n' bytes of data from 'src' to 'dest'.
  * 
@@ -0,0 +1,95 @@
+#include <interrupts/idle.h>
+#include <interrupts/timer.h>
+
+#include <debug_utils/printf.h>
+
+/**
+ * A registered idle work function.
+ */
+typedef struct idle_entry {
+    const char *name;
+    idle_work_t work;
+} idle_entry_t;
+
+idle_entry_t _idleWork[IDLE_MAX_WORK];
+uint32_t _idleWorkCount;
+
+volatile uint32_t _idleState = IDLE_BUSY;
+
+uint32_t _idleTicks;
+uint32_t _idleWorkTicks;
+uint32_t _busyTicks;
+
+/**
+ * Register a function to run when the CPU has nothing else to do.
+ * 
+ * @param name Name of the work (for debugging).
+ * @param work The function.
+ * 
+ * @return If there was room for it.
+ */
+bool idle_addWork(const char *name, idle_work_t work) {
+    if (_idleWorkCount == IDLE_MAX_WORK) {
+        printf("Idle: no room for %s\n", name);
+        return false;
+    }
+
+    _idleWork[_idleWorkCount].name = name;
+    _idleWork[_idleWorkCount].work = work;
+    _idleWorkCount++;
+    return true;
+}
+
+/**
+ * Called by the PIT handler at every tick: counts what the tick found the CPU doing.
+ */
+void idle_tick() {
+    if (_idleState == IDLE_HALTED)
+        _idleTicks++;
+    else if (_idleState == IDLE_WORKING)
+        _idleWorkTicks++;
+    else
+        _busyTicks++;
+}
+
+/**
+ * Run the idle work functions in turn, until none of them has anything to do 
+ * or IDLE_BUDGET_TICKS ticks have gone by.
+ */
+void idle_runWork() {
+    uint32_t start = tick;
+    bool worked = true;
+
+    while (worked) {
+        worked = false;
+
+        uint32_t i;
+        for (i = 0; i < _idleWorkCount; i++) {
+            if (tick - start >= IDLE_BUDGET_TICKS)
+                return;
+            if (_idleWork[i].work())
+                worked = true;
+        }
+    }
+}
+
+/**
+ * \brief The idle loop: where the kernel goes when it has nothing else to do. It never returns.
+ * 
+ * First the deferrable work is done (with a budget of IDLE_BUDGET_TICKS ticks), 
+ * then the CPU is halted until the next interrupt instead of spinning at 100%.
+ * 
+ * The sti right before the hlt matters: interrupts are enabled only after the next instruction,
+ * so an interrupt can't sneak in between the two and leave the CPU halted with work to do.
+ */
+void idle_loop() {
+    while (1) {
+        _idleState = IDLE_WORKING;
+        idle_runWork();
+
+        __asm__ __volatile__("cli");
+        _idleState = IDLE_HALTED;
+        __asm__ __volatile__("sti; hlt");
+        _idleState = IDLE_BUSY;
+    }
+}
@@ -17,9 +17,9 @@ interrupt_save_disable:
     pop eax
     cli
     ret
+; popfd puts IF back as it was, so save/restore pairs can be nested
 interrupt_restore:
     mov eax, [esp + 4]
     push eax
     popfd
-    sti
     ret
@@ -1,6 +1,9 @@
 #include <debug_utils/printf.h>
 #include <interrupts/isrs.h>
 #include <tables/idt.h>
+#include <tables/gdt.h>
+
+#include <mm/vmm.h>
 
 // Messages of the exceptions
 char *exception_messages[32] = {
@@ -53,7 +56,9 @@ void isrs_init() {
     idt_setGate(5, (uint32_t)isr5, 0x08, 0x8E);
     idt_setGate(6, (uint32_t)isr6, 0x08, 0x8E);
     idt_setGate(7, (uint32_t)isr7, 0x08, 0x8E);
-    idt_setGate(8, (uint32_t)isr8, 0x08, 0x8E);
+    // Double fault: a task gate (0x85), so it gets a stack of its own (see isr_doubleFault())
+    idt_setGate(8, 0, TSS_DOUBLE_FAULT_SELECTOR, 0x85);
+    gdt_setDoubleFault(&isr_doubleFault);
     idt_setGate(9, (uint32_t)isr9, 0x08, 0x8E);
     idt_setGate(10, (uint32_t)isr10, 0x08, 0x8E);
     idt_setGate(11, (uint32_t)isr11, 0x08, 0x8E);
@@ -84,19 +89,42 @@ void isrs_init() {
 /**
  * All of our Exception handling Interrupt Service Routines will point to this function. 
  * This will tell us what exception has happened.
- * Right now, we simply halt the system by hitting an endless loop. 
+ * Page faults go to the VMM first (see vHandleFault()), the rest of them simply halt the system by hitting an endless loop. 
  * All ISRs disable interrupts while they are being serviced as a 'locking' mechanism 
  * to prevent an IRQ from happening and messing up kernel data structures.
  */
 void isr_faultHandler(regs_t *r) {
+    // A page fault could just be the first touch of a lazily reserved page: the VMM maps it and we go back
+    if (r->int_no == 14 && vHandleFault(paging_get_cr2(), r->err_code))
+        return;
+
     if (r->int_no < 32) {
         // An exception: print error.
         set_color(RED, BLACK);
         printf("Exception: %s (err code %x)\n", exception_messages[r->int_no], r->err_code);
+        if (r->int_no == 14)
+            vReportFault(paging_get_cr2(), r->err_code);
         printf("DS:0x%x, CS:0x%x, ES:0x%x, GS:0x%x, FS:0x%x\n", r->ds, r->cs, r->es, r->gs, r->fs);
         printf("EAX:0x%x, EBX:0x%x, ECX:0x%x, EDX:0x%x\n", r->eax, r->ebx, r->ecx, r->edx);
         printf("ESP:0x%x, EBP:0x%x, EIP:0x%x, EDI:0x%x, ESI:0x%x\n", r->esp, r->ebp, r->eip, r->edi, r->esi);
         set_color(LIGHT_GREY, BLACK);
         for(;;) ;
     }
-}
\ No newline at end of file
+}
+
+/**
+ * The double fault handler. 
+ * It's a task of its own (through a task gate), with its own stack: a double fault is often a page fault 
+ * the CPU couldn't even push, because the kernel stack overflowed into its guard page, 
+ * so the handler can't run on that stack.
+ * 
+ * The registers of the kernel at the time of the fault are the ones the CPU saved in its TSS.
+ */
+void isr_doubleFault() {
+    set_color(RED, BLACK);
+    printf("Exception: %s\n", exception_messages[8]);
+    printf("EIP:0x%x, ESP:0x%x, EBP:0x%x, CR2:0x%x\n", _tss.eip, _tss.esp, _tss.ebp, paging_get_cr2());
+    vDescribeAddress(paging_get_cr2());
+    set_color(LIGHT_GREY, BLACK);
+    for(;;) ;
+}
@@ -1,16 +1,18 @@
 #include <interrupts/timer.h>
 #include <interrupts/irqs.h>
+#include <interrupts/idle.h>
 
 #include <debug_utils/printf.h>
 #include <debug_utils/serial.h>
 
-uint32_t tick = 0;
+volatile uint32_t tick = 0;
 
 void tickHandler(regs_t *r) {
     if (r->int_no == 0)
         printfSerial("%d\n", r->int_no);
     
     tick++;
+    idle_tick();
     outportb(0x20, 0x20); // End of interrupt
 }
 
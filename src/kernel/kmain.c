@@ -7,6 +7,8 @@
 #include <mm/pmm.h>
 #include <mm/vmm.h>
 #include <mm/kheap.h>
+#include <mm/modules.h>
+#include <interrupts/idle.h>
 
 #include <debug_utils/printf.h>
 #include <debug_utils/serial.h>
@@ -71,6 +73,17 @@
  * which will remove every .o file and the .iso image. 
  * You can then follow the **Executing** part to re-build the OS.
  * 
+ * \subsection Benchmarking the memory managers
+ * The physical memory manager, the kernel heap and the string functions can also be compiled for the host (no cross-compiler or emulator needed) 
+ * and run against a simulated memory map with random workloads:
+ * \code
+ * cd src
+ * make host-bench
+ * make host-bench PMM_BACKEND=bitmap
+ * make host-bench PMM_BACKEND=extent
+ * \endcode
+ * It prints ops/sec, p50/p99 latencies, fragmentation and metadata usage, and fails if an allocation is corrupted.
+ * 
  * \section Documentation
  * To document the code I'm using Doxygen.
  * Install it with:
@@ -149,9 +162,13 @@ void kmain(uint32_t *pd, multiboot_info_t* mbd, int n) {
     init_clock(100);
     printf("Clock initialized.\n\n");
 
+    // Before the PMM: GRUB's list of modules is in memory it gives away
+    init_modules(mbd);
     init_pmm(mbd, pd);
     printf("PMM initialized.\n");
     init_vmm();
+    vGuardBelow(&stack_guard, ((uint32_t)&start_stack - (uint32_t)&stack_guard) / PAGE_SIZE, "boot stack");
+    mapModules();
     printf("VMM initialized.\n\n");
 
     init_kheap();
@@ -162,5 +179,8 @@ void kmain(uint32_t *pd, multiboot_info_t* mbd, int n) {
 //  int num = 5 / 0;
 //  asm("int $4");
 
-    while (1);// __asm__ ("hlt");
+    // Nothing else to do: zero free frames for the PMM_ZERO allocations, give back the heap's free pages, and halt when they are done
+    idle_addWork("zero frames", &zeroIdlePMM);
+    idle_addWork("trim the heap", &kheapTrimIdle);
+    idle_loop();
 }
\ No newline at end of file
@@ -2,25 +2,395 @@
 #include <mm/pmm.h>
 #include <mm/vmm.h>
 
+#include <interrupts/interrupt.h>
+
 #include <common/utility.h>
 
 #include <debug_utils/printf.h>
 
-uint32_t *_kheapStart;       ///< Virtual address of where the heap starts
-uint32_t *_kheapEnd;         ///< Virtual address of where the heap ends (next available address)
-kheapHeader *_kheapFirst;    ///< The first block of the heap linked list
+/**
+ * \brief Kernel heap: segregated free lists with boundary tags.
+ * 
+ * Every block of the heap has a header and a footer with its size (the boundary tags), 
+ * so the blocks right before and right after a block are found in O(1), without any list: 
+ * a freed block is merged with both of them if they are free, and two free blocks are never next to each other.
+ * 
+ * The free blocks are in size classes, with a doubly linked free list each, and a bitmap of the classes that have any: 
+ * kmalloc() takes the first block of the first class that surely fits (a bsf) and splits what it doesn't need, 
+ * kfree() merges and puts the result in its class. Neither walks anything. 
+ * The big allocations (more than KHEAP_MAX_SMALL) have pages of their own instead, given back to the VMM when they are freed.
+ * 
+ * kheapVerify() walks the whole heap and checks all of this.
+ * 
+ * The heap only takes frames for the pages it touches, but it would keep them forever: 
+ * the whole pages of the free blocks are given back (see kheapTrim()), the end of the heap right when it gets too big, 
+ * the rest when the CPU is idle. They are still in the lazy reservation, so touching them again just maps new zeroed frames.
+ */
+
+#define KHEAP_FOOTER sizeof(uint32_t)                           ///< The footer is the size of the block again
+#define KHEAP_OVERHEAD (sizeof(kheapHeader) + KHEAP_FOOTER)     ///< Bytes of a block that aren't given by kmalloc()
+#define KHEAP_MIN_SPLIT 32                                      ///< Smallest free block (header, the list links, footer)
+
+uint8_t *_kheapStart;        ///< Virtual address of where the heap starts
+uint8_t *_kheapEnd;          ///< Virtual address of where the heap ends (next available address)
+uint32_t _kheapReclaimed;    ///< Bytes of frames given back to the PMM by trimming the heap
+
+/**
+ * The links of a free block, right after its header (where the memory of an allocated block is).
+ */
+typedef struct _kheapFree {
+    struct _kheapFree *prev;        ///< Previous free block of the same class
+    struct _kheapFree *next;        ///< Next free block of the same class
+} kheapFree;
+
+kheapFree *_kheapClasses[KHEAP_CLASSES];     ///< Free list of each size class
+uint32_t _kheapNonEmpty;                     ///< Bit i is set if the list of class i has any block
+
+/**
+ * Bytes of each size class: powers of 2 and the halves between them. 
+ * Class i has the free blocks that can hold from _kheapClassSize[i] bytes up to the next class (the last one, anything bigger).
+ */
+const uint32_t _kheapClassSize[KHEAP_CLASSES] = {
+    16, 24, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048, 3072, 4096
+};
 
 /**
  * Initialize kernel heap.
  * 
- * This is done with a linked list.
- * The starting address will be after the PMM stack.
+ * All of its KHEAP_LENGTH bytes are reserved right away, but lazily (see vReserveLazy()): 
+ * a page of the heap gets a frame only when it's touched for the first time, 
+ * so growing the heap is just moving _kheapEnd.
  */
 void init_kheap() {
-    _kheapStart = roundPageAligned((free_mem_t *)&end) + _halfMaxStack;
+    uint32_t i;
+
+    _kheapStart = vReserveLazy((void *)0, BIT_PD_PT_PRESENT | BIT_PD_PT_RW, KHEAP_LENGTH / PAGE_SIZE, false);
     _kheapEnd = _kheapStart;
+    for (i = 0; i < KHEAP_CLASSES; i++)
+        _kheapClasses[i] = NULL;
+    _kheapNonEmpty = 0;
+
+    if (!_kheapStart)
+        printf("KHEAP: no room for the heap\n");
+    else
+        vNameRegion(_kheapStart, KHEAP_LENGTH / PAGE_SIZE, "the kernel heap");
+}
+
+/**
+ * Size class of an allocation: the smallest one that fits it, in O(1) (a bsr).
+ * 
+ * @param size Bytes (up to KHEAP_MAX_SMALL).
+ */
+uint32_t classOf(uint32_t size) {
+    if (size <= KHEAP_MIN_BLOCK)
+        return 0;
+
+    // size - 1 is in [2^p, 2^(p+1)): the class is 2^p * 1.5 or 2^(p+1), by the bit after the highest one
+    uint32_t p = 31 - __builtin_clz(size - 1);
+    return 2 * (p - 4) + (((size - 1) >> (p - 1)) & 1) + 1;
+}
+
+/**
+ * Size class of a free block: the biggest one it can hold.
+ * 
+ * @param size Bytes the block can hold (at least KHEAP_MIN_BLOCK).
+ */
+uint32_t freeClassOf(uint32_t size) {
+    if (size >= KHEAP_MAX_SMALL)
+        return KHEAP_CLASSES - 1;
+
+    uint32_t class = classOf(size);
+    return _kheapClassSize[class] > size ? class - 1 : class;
+}
+
+/**
+ * If an address is a block of the heap (and not a large one, which has pages of its own).
+ */
+bool inHeap(void *addr) {
+    return (uint8_t *)addr >= _kheapStart && (uint8_t *)addr < _kheapEnd;
+}
+
+uint32_t sizeOf(kheapHeader *block) {
+    return block->size & ~KHEAP_FLAGS;
+}
+
+uint32_t *footerOf(kheapHeader *block) {
+    return (uint32_t *)((uint8_t *)block + sizeOf(block) - KHEAP_FOOTER);
+}
+
+/**
+ * The block right after this one, or null if it's the last one.
+ */
+kheapHeader *nextBlock(kheapHeader *block) {
+    uint8_t *next = (uint8_t *)block + sizeOf(block);
+    return next < _kheapEnd ? (kheapHeader *)next : NULL;
+}
+
+/**
+ * The block right before this one (found from its footer), or null if it's the first one.
+ */
+kheapHeader *prevBlock(kheapHeader *block) {
+    if ((uint8_t *)block == _kheapStart)
+        return NULL;
+    return (kheapHeader *)((uint8_t *)block - (*((uint32_t *)block - 1) & ~KHEAP_FLAGS));
+}
+
+/**
+ * Write both boundary tags of a block.
+ * 
+ * @param size Bytes of the whole block (multiple of 8).
+ * @param used KHEAP_USED or 0.
+ */
+void setBlock(kheapHeader *block, uint32_t size, uint32_t used) {
+    block->size = size | used;
+    block->magic = KHEAP_MAGIC;
+    *footerOf(block) = size | used;
 }
 
+/**
+ * Put a free block at the head of the list of its class.
+ */
+void linkFree(kheapHeader *block) {
+    uint32_t class = freeClassOf(sizeOf(block) - KHEAP_OVERHEAD);
+    kheapFree *free = (kheapFree *)(block + 1);
+
+    free->prev = NULL;
+    free->next = _kheapClasses[class];
+    if (free->next)
+        free->next->prev = free;
+    _kheapClasses[class] = free;
+    _kheapNonEmpty |= 1 << class;
+}
+
+/**
+ * Take a free block out of the list of its class.
+ */
+void unlinkFree(kheapHeader *block) {
+    uint32_t class = freeClassOf(sizeOf(block) - KHEAP_OVERHEAD);
+    kheapFree *free = (kheapFree *)(block + 1);
+
+    if (free->prev)
+        free->prev->next = free->next;
+    else
+        _kheapClasses[class] = free->next;
+    if (free->next)
+        free->next->prev = free->prev;
+    if (!_kheapClasses[class])
+        _kheapNonEmpty &= ~(1 << class);
+}
+
+/**
+ * Allocate a block with pages of its own, for what is bigger than the biggest size class.
+ * It would be the whole of a free block of the heap, or it would push the end of the heap, for a long time.
+ */
+void *largeMalloc(uint32_t size) {
+    uint32_t n = roundPageAligned(size + KHEAP_OVERHEAD) / PAGE_SIZE;
+    kheapHeader *block = vAllocPages((void *)0, BIT_PD_PT_PRESENT | BIT_PD_PT_RW, n, false);
+    if (!block)
+        return NULL;
+
+    setBlock(block, n * PAGE_SIZE, KHEAP_USED);
+    return block + 1;
+}
+
+/**
+ * Unmap pages of the heap: the frames they had go back to the PMM.
+ * 
+ * @return Bytes of frames given back (pages that were never touched had none).
+ */
+uint32_t releasePages(uint8_t *from, uint32_t n) {
+    uint32_t before = _freePages;
+
+    vUnmapRange(from, n);
+    uint32_t bytes = (_freePages - before) * PAGE_SIZE;
+    _kheapReclaimed += bytes;
+    return bytes;
+}
+
+/**
+ * Shrink the free block at the end of the heap to KHEAP_TRIM_KEEP bytes (more, to end at a page boundary) 
+ * and give back the pages after it: _kheapEnd goes back to where the block ends.
+ * 
+ * @param last The last block of the heap (it must be free).
+ * @return Bytes given back.
+ */
+uint32_t trimTail(kheapHeader *last) {
+    uint8_t *cut = (uint8_t *)roundPageAligned((uint32_t)last + KHEAP_TRIM_KEEP);
+    uint8_t *end = (uint8_t *)roundPageAligned((uint32_t)_kheapEnd);
+    if (cut >= end)
+        return 0;
+
+    unlinkFree(last);
+    _kheapEnd = cut;
+    setBlock(last, cut - (uint8_t *)last, 0);
+    linkFree(last);
+    return releasePages(cut, (end - cut) / PAGE_SIZE);
+}
+
+/**
+ * Give back the whole pages inside a free block (not the ones with its header, links or footer), 
+ * if there are at least KHEAP_TRIM_MIN bytes of them, and mark it KHEAP_TRIMMED.
+ * 
+ * @return Bytes given back.
+ */
+uint32_t trimBlock(kheapHeader *block) {
+    uint8_t *from = (uint8_t *)roundPageAligned((uint32_t)block + sizeof(kheapHeader) + sizeof(kheapFree));
+    uint8_t *to = (uint8_t *)(((uint32_t)footerOf(block)) & ~(PAGE_SIZE - 1));
+
+    block->size |= KHEAP_TRIMMED;
+    *footerOf(block) = block->size;
+    if (to <= from || to - from < KHEAP_TRIM_MIN)
+        return 0;
+    return releasePages(from, (to - from) / PAGE_SIZE);
+}
+
+/**
+ * The last block of the heap, if it's free and bigger than what trimTail() keeps.
+ */
+kheapHeader *trimmableTail() {
+    kheapHeader *last = prevBlock((kheapHeader *)_kheapEnd);
+    if (!last || (last->size & KHEAP_USED) || sizeOf(last) <= KHEAP_TRIM_KEEP + PAGE_SIZE)
+        return NULL;
+    return last;
+}
+
+/**
+ * Resize a block with pages of its own where it is: the pages it doesn't need are given back, 
+ * the ones it needs are mapped right after it, if nothing else is there.
+ * 
+ * @param block The block (see largeMalloc()).
+ * @param size New size (more than KHEAP_MAX_SMALL).
+ * 
+ * @return If it was resized (false if the pages after it are taken, or there is no memory).
+ */
+bool resizeLarge(kheapHeader *block, uint32_t size) {
+    uint32_t pages = sizeOf(block) / PAGE_SIZE;
+    uint32_t n = roundPageAligned(size + KHEAP_OVERHEAD) / PAGE_SIZE;
+    uint8_t *end = (uint8_t *)block + pages * PAGE_SIZE;
+
+    if (n < pages)
+        vFreePages(end - (pages - n) * PAGE_SIZE, pages - n);
+    else if (n > pages && !vAllocPages(end, BIT_PD_PT_PRESENT | BIT_PD_PT_RW, n - pages, true))
+        return false;
+
+    setBlock(block, n * PAGE_SIZE, KHEAP_USED);
+    return true;
+}
+
+/**
+ * Bytes of the block for an allocation: the memory, the boundary tags and the alignment (at least KHEAP_MIN_SPLIT).
+ */
+uint32_t blockSize(uint32_t size) {
+    uint32_t need = (size + KHEAP_OVERHEAD + 7) & ~7;
+    return need < KHEAP_MIN_SPLIT ? KHEAP_MIN_SPLIT : need;
+}
+
+/**
+ * Cut an allocated block to need bytes: what is left after it, if it's enough for a block, 
+ * becomes a free block (merged with the next one, if that's free too).
+ * 
+ * @param block The block (allocated, with at least need bytes).
+ * @param need Bytes to keep (see blockSize()).
+ */
+void splitBlock(kheapHeader *block, uint32_t need) {
+    uint32_t left = sizeOf(block) - need;
+    if (left < KHEAP_MIN_SPLIT)
+        return;
+
+    kheapHeader *next = nextBlock(block);
+    kheapHeader *rest = (kheapHeader *)((uint8_t *)block + need);
+    if (next && !(next->size & KHEAP_USED)) {
+        unlinkFree(next);
+        left += sizeOf(next);
+    }
+
+    setBlock(block, need, KHEAP_USED);
+    setBlock(rest, left, 0);
+    linkFree(rest);
+    if (!nextBlock(rest) && left >= KHEAP_TRIM_THRESHOLD)
+        trimTail(rest);
+}
+
+/**
+ * If an address is something kmalloc() gave and that wasn't freed yet (checked with its boundary tags).
+ */
+bool isAllocated(void *addr) {
+    kheapHeader *block = (kheapHeader *)addr - 1;
+
+    if (((uint32_t)addr & 7) || block->magic != KHEAP_MAGIC || !(block->size & KHEAP_USED) || *footerOf(block) != block->size) {
+        printf("KHEAP: 0x%x isn't an allocated block\n", addr);
+        return false;
+    }
+    return true;
+}
+
+#ifdef KHEAP_GUARD
+/**
+ * Heap debug mode (make KHEAP_GUARD=1).
+ * 
+ * Every allocation gets pages of its own between two guard pages (see vAllocGuarded()), 
+ * and ends right where the upper guard page starts: writing a single byte past its end is a page fault, 
+ * reported with the allocation's range, instead of a corruption of the next block found much later. 
+ * It's one page (plus two of virtual addresses) for every allocation, so it's for hunting overflows only.
+ * A guarded block has no footer, and its size is what was asked rounded up to 8, 
+ * so the pointers are 8 bytes aligned like kmalloc()'s (an overflow of less than 8 bytes isn't caught).
+ */
+void *guardMalloc(uint32_t size) {
+    if (size == 0)
+        return NULL;
+
+    size = (size + KHEAP_FLAGS) & ~KHEAP_FLAGS;
+    uint32_t n = roundPageAligned(size + sizeof(kheapHeader)) / PAGE_SIZE;
+    uint8_t *pages = vAllocGuarded(BIT_PD_PT_PRESENT | BIT_PD_PT_RW, n, "a kmalloc block (KHEAP_GUARD)");
+    if (!pages)
+        return NULL;
+
+    kheapHeader *block = (kheapHeader *)(pages + n * PAGE_SIZE - size) - 1;
+    block->size = size;
+    block->magic = KHEAP_MAGIC;
+    return block + 1;
+}
+
+void *guardFree(void *addr) {
+    if (!addr)
+        return NULL;
+
+    kheapHeader *block = (kheapHeader *)addr - 1;
+    if (((uint32_t)addr & KHEAP_FLAGS) || block->magic != KHEAP_MAGIC) {
+        printf("KHEAP: 0x%x isn't an allocated block\n", addr);
+        return NULL;
+    }
+    uint32_t n = roundPageAligned(block->size + sizeof(kheapHeader)) / PAGE_SIZE;
+
+    // The block ends where the upper guard page starts
+    block->magic = 0;
+    vFreeGuarded((uint8_t *)addr + block->size - n * PAGE_SIZE, n);
+    return addr;
+}
+
+void *guardRealloc(void *ptr, uint32_t newSize) {
+    if (!ptr)
+        return guardMalloc(newSize);
+    if (newSize == 0) {
+        guardFree(ptr);
+        return NULL;
+    }
+
+    kheapHeader *block = (kheapHeader *)ptr - 1;
+    if (((uint32_t)ptr & KHEAP_FLAGS) || block->magic != KHEAP_MAGIC) {
+        printf("KHEAP: 0x%x isn't an allocated block\n", ptr);
+        return NULL;
+    }
+    uint8_t *new_ptr = guardMalloc(newSize);
+    if (!new_ptr)
+        return NULL;
+
+    memcpy(new_ptr, ptr, block->size < newSize ? block->size : newSize);
+    guardFree(ptr);
+    return new_ptr;
+}
+#endif
+
 /**
  * \brief Function to allocate the heap for the kernel.
  * 
@@ -31,90 +401,58 @@ void init_kheap() {
  * This is used to dynamically allocate a single large block of memory with the specified size. 
  * It returns a pointer of type void which can be cast into a pointer of any form.
  * 
+ * The block is the first one of the first class with anything, starting from the class of the size 
+ * (so it surely fits), and what is left of it is split into a free block of its own. 
+ * If there isn't any, it's a new one from the end of the heap (merged with the last block, if that's free). 
+ * What is bigger than KHEAP_MAX_SMALL gets pages of its own (see largeMalloc()).
+ * 
  * @param size Size (in bytes) to be allocated.
  * 
- * @return Allocated pointer
+ * @return Allocated pointer (8 bytes aligned) or NULL
  */
 void *kmalloc(uint32_t size) {
-    int n = roundPageAligned(size + sizeof(kheapHeader)) / PAGE_SIZE;
-    if (_kheapFirst == NULL) {
-        //If the first block isn't allocated, allocate it.
-        _kheapFirst = vAllocPages(_kheapStart, BIT_PD_PT_PRESENT | BIT_PD_PT_RW, n, true);
-        if(!_kheapFirst)
+#ifdef KHEAP_GUARD
+    return guardMalloc(size);
+#endif
+    if (size == 0 || !_kheapStart)
+        return NULL;
+    if (size > KHEAP_MAX_SMALL)
+        return largeMalloc(size);
+
+    uint32_t need = blockSize(size);
+    uint32_t eflags = interrupt_save_disable();
+    uint32_t classes = _kheapNonEmpty & ~((1 << classOf(size)) - 1);
+    kheapHeader *block;
+
+    if (classes) {
+        block = (kheapHeader *)_kheapClasses[__builtin_ctz(classes)] - 1;
+        unlinkFree(block);
+    } else {
+        // No free block fits: push the end of the heap (extending the free block at the end, if any).
+        // The range is already reserved, its frames are mapped on first touch
+        block = (kheapHeader *)_kheapEnd;
+        kheapHeader *last = prevBlock(block);
+        if (last && !(last->size & KHEAP_USED))
+            block = last;
+
+        if ((uint8_t *)block + need > _kheapStart + KHEAP_LENGTH) {
+            // Run out of memory
+            interrupt_restore(eflags);
             return NULL;
-        _kheapEnd += n * PAGE_SIZE;
-        _kheapFirst->size = n * PAGE_SIZE;
-        _kheapFirst->prev = NULL;
-    }
-
-    kheapHeader *block = _kheapFirst;
-    while (block->next != NULL) {
-        if (block->size == size) {
-            // Eliminate this block from the list and return it
-            block->prev->next = block->next;
-            block->next->prev = block->prev;
-            return block + sizeof(kheapHeader);
-
-        } else if (block->size > size) {
-            // Modify the block subtracting the size
-            block->size -= (size + sizeof(kheapHeader));
-
-            kheapHeader *ret_block = (uint32_t)block + block->size;
-            ret_block->size = size;
-            // Set this up to have an easier freeing
-            ret_block->prev = block;
-            ret_block->next = block->next;
-
-            // Then return the calculated free address
-            return (void *)((uint32_t)ret_block + sizeof(kheapHeader));
         }
-        block = block->next;
-    } 
-    // Check on the last block (in this way, I won't lose it)
-    if (block->size == size) {
-        // Eliminate this block from the list and return it
-        block->prev->next = block->next;
-        block->next->prev = block->prev;
-        return block + sizeof(kheapHeader);
-
-    } else if (block->size > size) {
-        // Modify the block subtracting the size
-        block->size -= (size + sizeof(kheapHeader));
-
-        kheapHeader *ret_block = (uint32_t)block + block->size;
-        ret_block->size = size;
-        // Set this up to have an easier freeing
-        ret_block->prev = block;
-        ret_block->next = block->next;
-
-        // Then return the calculated free address
-        return (void *)((uint32_t)ret_block + sizeof(kheapHeader));
+        if (block == last)
+            unlinkFree(block);
+        if ((uint8_t *)block + need > _kheapEnd)
+            _kheapEnd = (uint8_t *)block + need;
+        setBlock(block, _kheapEnd - (uint8_t *)block, 0);
     }
-    
-    if ((uint32_t)_kheapEnd + n * PAGE_SIZE > (uint32_t)_kheapStart + KHEAP_LENGTH) {
-        // Run out of memory
-        return NULL;
-    }
-
-    // No memory, but available request some
-    kheapHeader *new_block;
-    new_block = vAllocPages(_kheapEnd, BIT_PD_PT_PRESENT | BIT_PD_PT_RW, n, true);
-    if (!new_block)
-        return NULL;
-    _kheapEnd += (n * PAGE_SIZE); 
-
-    new_block->size = n * PAGE_SIZE - size - sizeof(kheapHeader);
-    new_block->prev = block;
-    new_block->next = NULL;
 
-    block->next = new_block;
+    // Split what isn't needed
+    setBlock(block, sizeOf(block), KHEAP_USED);
+    splitBlock(block, need);
 
-    // Take the last part of the new chunk and return it
-    kheapHeader *ret_block = new_block + new_block->size;
-    ret_block->size = size;
-    ret_block->prev = new_block;
-    ret_block->next = NULL;
-    return ret_block + sizeof(kheapHeader);
+    interrupt_restore(eflags);
+    return block + 1;
 }
 
 /**
@@ -123,67 +461,169 @@ void *kmalloc(uint32_t size) {
  * Hence the free() method is used, whenever the dynamic memory allocation takes place. 
  * It helps to reduce wastage of memory by freeing it.
  * 
+ * The block is merged with the blocks right before and right after it if they are free 
+ * (found from the boundary tags, in O(1)), then put in the free list of its class. 
+ * If that makes a free block of KHEAP_TRIM_THRESHOLD bytes at the end of the heap, the heap is trimmed.
+ * 
  * @param addr Address to free.
  * 
- * @return The freed address or NULL.
+ * @return The freed address or NULL (if it wasn't allocated by kmalloc()).
  */
 void *kfree(void *addr) {
-    kheapHeader *free_block = (uint32_t)addr - sizeof(kheapHeader);
-    kheapHeader *tmp = _kheapFirst;
-    
-    while (tmp->next != NULL) {
-        if ((free_block + free_block->size) == tmp) {
-            // They're contiguous (free_block is behind), merge the blocks
-            tmp->size += free_block->size;
-            tmp = free_block;   // TODO: VERIFY THIS
-            return tmp;
-        
-        } else if (free_block->next == tmp) {
-            // Just add the block
-            free_block->prev = tmp->prev;
-            tmp->prev = free_block;
-            return free_block;
-
-        } else if ((tmp + tmp->size) == free_block) {
-            // They're contiguous (free_block is in the front), merge the blocks
-            tmp->size += free_block->size;
-            return tmp;
-        
-        } else if (free_block->prev <= tmp) {
-            // Just add the block
-            free_block->next = tmp->prev;
-            tmp->next = free_block;
-            return free_block;
+#ifdef KHEAP_GUARD
+    return guardFree(addr);
+#endif
+    if (!addr)
+        return NULL;
+
+    if (!isAllocated(addr))
+        return NULL;
+
+    kheapHeader *block = (kheapHeader *)addr - 1;
+
+    if (!inHeap(block)) {
+        vFreePages(block, sizeOf(block) / PAGE_SIZE);
+        return addr;
+    }
+
+    uint32_t eflags = interrupt_save_disable();
+    uint32_t size = sizeOf(block);
+    kheapHeader *next = nextBlock(block);
+    kheapHeader *prev = prevBlock(block);
+
+    if (next && !(next->size & KHEAP_USED)) {
+        unlinkFree(next);
+        size += sizeOf(next);
+    }
+    if (prev && !(prev->size & KHEAP_USED)) {
+        unlinkFree(prev);
+        size += sizeOf(prev);
+        block = prev;
+    }
+
+    setBlock(block, size, 0);
+    linkFree(block);
+
+    // A big free block at the end goes back right away (the rest waits for kheapTrimIdle())
+    if (!nextBlock(block) && size >= KHEAP_TRIM_THRESHOLD)
+        trimTail(block);
+    interrupt_restore(eflags);
+    return addr;
+}
+
+/**
+ * Give back to the PMM every frame the heap doesn't need: 
+ * the end of the heap, after its last free block (see trimTail()), 
+ * and the whole pages inside the big free blocks (see trimBlock()).
+ * 
+ * It walks the free list of the biggest class (the only one with blocks that have whole pages). 
+ * The last block is left alone: the KHEAP_TRIM_KEEP bytes trimTail() keeps are meant to stay mapped.
+ * 
+ * @return Bytes given back (_kheapReclaimed has the total).
+ */
+uint32_t kheapTrim() {
+    uint32_t eflags = interrupt_save_disable();
+    uint32_t bytes = 0;
+    kheapHeader *last = trimmableTail();
+    kheapFree *free;
+
+    if (last)
+        bytes += trimTail(last);
+    for (free = _kheapClasses[KHEAP_CLASSES - 1]; free; free = free->next) {
+        kheapHeader *block = (kheapHeader *)free - 1;
+        if (!(block->size & KHEAP_TRIMMED) && nextBlock(block))
+            bytes += trimBlock(block);
+    }
+    interrupt_restore(eflags);
+    return bytes;
+}
+
+/**
+ * Idle work: trim the end of the heap, or a single big free block that wasn't trimmed yet (not the last one, see kheapTrim()).
+ * 
+ * @return If something was trimmed (false when there is nothing left to trim).
+ */
+bool kheapTrimIdle() {
+    uint32_t eflags = interrupt_save_disable();
+    kheapHeader *last = trimmableTail();
+    kheapFree *free;
+
+    if (last) {
+        trimTail(last);
+        interrupt_restore(eflags);
+        return true;
+    }
+    for (free = _kheapClasses[KHEAP_CLASSES - 1]; free; free = free->next) {
+        kheapHeader *block = (kheapHeader *)free - 1;
+        if (!(block->size & KHEAP_TRIMMED) && nextBlock(block)) {
+            trimBlock(block);
+            interrupt_restore(eflags);
+            return true;
+        }
+    }
+    interrupt_restore(eflags);
+    return false;
+}
+
+/**
+ * Walk the whole heap and check it: the boundary tags of every block, 
+ * that no two free blocks are next to each other (kfree() always merges them), 
+ * and that the free lists have all of the free blocks, each in the right class, and nothing else.
+ * 
+ * It's O(size of the heap), for debugging and tests.
+ * 
+ * @return If the heap is consistent (what's wrong is printed).
+ */
+bool kheapVerify() {
+    uint32_t eflags = interrupt_save_disable();
+    uint32_t blocks = 0, free = 0, listed = 0, i;
+    bool ok = true, prevFree = false;
+    kheapHeader *block = (kheapHeader *)_kheapStart;
+
+    while (ok && block && (uint8_t *)block < _kheapEnd) {
+        uint32_t size = sizeOf(block);
+        bool isFree = !(block->size & KHEAP_USED);
+
+        if (block->magic != KHEAP_MAGIC || size < KHEAP_MIN_SPLIT || (size & 7) || (uint8_t *)block + size > _kheapEnd) {
+            printf("KHEAP: bad header at 0x%x (size 0x%x)\n", block, block->size);
+            ok = false;
+        } else if (*footerOf(block) != block->size) {
+            printf("KHEAP: footer of 0x%x doesn't match its header\n", block);
+            ok = false;
+        } else if (isFree && prevFree) {
+            printf("KHEAP: free blocks before 0x%x weren't merged\n", block);
+            ok = false;
+        }
+
+        blocks++;
+        if (isFree)
+            free++;
+        prevFree = isFree;
+        block = nextBlock(block);
+    }
 
+    for (i = 0; ok && i < KHEAP_CLASSES; i++) {
+        kheapFree *f;
+        if (!_kheapClasses[i] != !(_kheapNonEmpty & (1 << i))) {
+            printf("KHEAP: class %u isn't empty as the bitmap says\n", i);
+            ok = false;
+        }
+        for (f = _kheapClasses[i]; ok && f; f = f->next) {
+            kheapHeader *b = (kheapHeader *)f - 1;
+            if (!inHeap(b) || (b->size & KHEAP_USED) || freeClassOf(sizeOf(b) - KHEAP_OVERHEAD) != i || (f->next && f->next->prev != f)) {
+                printf("KHEAP: bad block 0x%x in the free list of class %u\n", b, i);
+                ok = false;
+            }
+            listed++;
         }
-        tmp = tmp->next;
     }
-    // For the last block
-    if ((free_block + free_block->size) == tmp) {
-        // They're contiguous (free_block is behind), merge the blocks
-        tmp->size += free_block->size;
-        tmp = free_block;   // TODO: VERIFY THIS
-        return tmp;
-    
-    } else if (free_block->next == tmp) {
-        // Just add the block
-        free_block->prev = tmp->prev;
-        tmp->prev = free_block;
-        return free_block;
-
-    } else if ((tmp + tmp->size) == free_block) {
-        // They're contiguous (free_block is in the front), merge the blocks
-        tmp->size += free_block->size;
-        return tmp;
-    
-    } else if (free_block->prev <= tmp) {
-        // Just add the block
-        free_block->next = tmp->prev;
-        tmp->next = free_block;
-        return free_block;
 
+    if (ok && listed != free) {
+        printf("KHEAP: %u free blocks, but %u in the free lists\n", free, listed);
+        ok = false;
     }
-    return NULL;
+    interrupt_restore(eflags);
+    return ok;
 }
 
 /**
@@ -196,13 +636,14 @@ void *kfree(void *addr) {
  * @return Allocated pointer or NULL
  */
 void *kcalloc(uint32_t n, uint32_t size) {
-    uint32_t *ptr = kmalloc(n * size);
-    if (!ptr)
+    if (size != 0 && n > 0xFFFFFFFF / size)
         return NULL;
 
-    memsetw(ptr, 0, n);
+    void *ptr = kmalloc(n * size);
     if (!ptr)
         return NULL;
+
+    memset(ptr, 0, n * size);
     return ptr;
 }
 
@@ -211,55 +652,70 @@ void *kcalloc(uint32_t n, uint32_t size) {
  * In other words, if the memory previously allocated with the help of malloc or calloc is insufficient, 
  * realloc can be used to dynamically re-allocate memory.
  * 
- * @param ptr Pointer to reallocate
- * @param newSize New size
+ * The block is resized where it is whenever it can be, so buffers that keep growing don't get copied every time: 
+ *      - smaller: the end of the block is split into a free block
+ *      - bigger: the block takes the free block right after it, if that's enough, 
+ *        or pushes the end of the heap, if it's the last block (after taking the free one, if any)
+ * Only when neither works the memory is copied to a new block. 
+ * A block with pages of its own (see largeMalloc()) gives back the pages it doesn't need anymore, 
+ * or maps new ones right after its own if they are free (see resizeLarge()).
  * 
- * @return New pointer or NULL
+ * @param ptr Pointer to reallocate (NULL is the same as kmalloc())
+ * @param newSize New size (0 is the same as kfree())
+ * 
+ * @return New pointer or NULL (then ptr is still allocated, unless newSize was 0)
  */
 void *krealloc(void *ptr, uint32_t newSize) {
-    kheapHeader *block = ptr - sizeof(kheapHeader);
-    kheapHeader *tmp = _kheapFirst;
-
-    if (newSize <= block->size)
+#ifdef KHEAP_GUARD
+    return guardRealloc(ptr, newSize);
+#endif
+    if (!ptr)
+        return kmalloc(newSize);
+    if (newSize == 0) {
+        kfree(ptr);
+        return NULL;
+    }
+    if (!isAllocated(ptr))
         return NULL;
 
-    while(tmp->next != NULL) {
-        if (block + block->size == tmp) {
-            // This is a contiguous chunk of memory
-            block->size += (newSize - block->size);
-
-            // Set up the new shifted block 
-            kheapHeader *new_block = tmp + (newSize - block->size);
-            new_block->prev = tmp->prev;
-            new_block->next = tmp->next;
+    kheapHeader *block = (kheapHeader *)ptr - 1;
+    uint32_t size = sizeOf(block) - KHEAP_OVERHEAD;
+    if (!inHeap(block)) {
+        if (newSize > KHEAP_MAX_SMALL && resizeLarge(block, newSize))
+            return ptr;
+    } else if (newSize <= KHEAP_MAX_SMALL) {
+        uint32_t need = blockSize(newSize);
+        uint32_t eflags = interrupt_save_disable();
+        kheapHeader *next = nextBlock(block);
+        uint32_t room = sizeOf(block);
+
+        if (next && !(next->size & KHEAP_USED)) {
+            room += sizeOf(next);
+            next = nextBlock(next);
+        }
 
-            tmp->prev->next = new_block;
-            tmp->next->prev = new_block;            
-            return block;
+        if (room >= need || (!next && (uint8_t *)block + need <= _kheapStart + KHEAP_LENGTH)) {
+            // Take the free block after it (if any), and the end of the heap if that's still not enough
+            if (room > sizeOf(block))
+                unlinkFree(nextBlock(block));
+            if (room < need) {
+                room = need;
+                _kheapEnd = (uint8_t *)block + need;
+            }
+            setBlock(block, room, KHEAP_USED);
+            splitBlock(block, need);
+            interrupt_restore(eflags);
+            return ptr;
         }
-        tmp = tmp->next;
-    }
-    // Last block
-    if (block + block->size == tmp) {
-        // This is a contiguous chunk of memory
-        block->size += (newSize - block->size);
-
-        // Set up the new shifted block 
-        kheapHeader *new_block = tmp + (newSize - block->size);
-        new_block->prev = tmp->prev;
-        new_block->next = tmp->next;
-
-        tmp->prev->next = new_block;
-        tmp->next->prev = new_block;            
-        return block;
+        interrupt_restore(eflags);
     }
 
     // Otherwise find an entire new block and copy everything
-    uint32_t new_ptr = kmalloc(newSize);
+    void *new_ptr = kmalloc(newSize);
     if (!new_ptr)
         return NULL;
 
-    memcpy(new_ptr, ptr, block->size);
-    kfree(block);
+    memcpy(new_ptr, ptr, size < newSize ? size : newSize);
+    kfree(ptr);
     return new_ptr;
-}
\ No newline at end of file
+}
@@ -0,0 +1,112 @@
+#include <mm/modules.h>
+#include <mm/pmm.h>
+#include <mm/vmm.h>
+
+#include <common/string.h>
+
+#include <debug_utils/printf.h>
+
+/**
+ * \brief Zero-copy access to the multiboot modules.
+ * 
+ * GRUB loads the files of the 'module' lines of grub.cfg in memory next to the kernel (build.sh ships everything in ./modules). 
+ * They are never copied: the PMM leaves their frames out of the free ones (and puts its metadata after them, see placeMetadata()), 
+ * and mapModules() maps them in place, read-only, in the kernel's virtual addresses. 
+ * So an initrd, test data or a workload costs its size once, and nothing at boot.
+ */
+
+boot_module_t _modules[MODULES_MAX];
+uint32_t _nModules;
+
+/**
+ * Copy the name of a module: the last part of the path of the first word of its command line 
+ * (so both "module /boot/modules/data" and "module /boot/modules/data data" give "data").
+ */
+void moduleName(char *name, const char *cmdline, uint32_t index) {
+    const char *s = cmdline, *base = cmdline;
+    uint32_t i = 0;
+
+    if (!cmdline || !*cmdline) {
+        // No name: module0, module1...
+        char digits[12];
+        const char *prefix = "module";
+        while (*prefix)
+            name[i++] = *prefix++;
+        utoa(index, digits, 10);
+        for (s = digits; *s && i < MODULE_NAME - 1; s++)
+            name[i++] = *s;
+        name[i] = '\0';
+        return;
+    }
+
+    for (; *s && *s != ' '; s++)
+        if (*s == '/')
+            base = s + 1;
+    for (s = base; *s && *s != ' ' && i < MODULE_NAME - 1; s++)
+        name[i++] = *s;
+    name[i] = '\0';
+}
+
+/**
+ * Find the modules GRUB loaded.
+ * It must run before init_pmm(): the list and the command lines are somewhere in memory the PMM will give away, 
+ * so what is needed is copied now (through the identity mapping of the boot page directory, like the memory map).
+ * 
+ * @param mbt GRUB's multiboot structure.
+ */
+void init_modules(multiboot_info_t *mbt) {
+    _nModules = 0;
+    if (!(mbt->flags & 0x8))
+        return;
+
+    module_t *mods = (module_t *)mbt->mods_addr;
+    uint32_t i;
+    for (i = 0; i < mbt->mods_count && _nModules < MODULES_MAX; i++) {
+        boot_module_t *m = &_modules[_nModules++];
+        m->phys = mods[i].mod_start;
+        m->size = mods[i].mod_end - mods[i].mod_start;
+        m->data = NULL;
+        moduleName(m->name, (const char *)mods[i].string, i);
+    }
+}
+
+/**
+ * Map every module read-only, where it is (after init_vmm()).
+ * The mappings don't own their frames (they are reserved, not allocated), so nothing is ever freed.
+ */
+void mapModules() {
+    uint32_t i;
+
+    for (i = 0; i < _nModules; i++) {
+        boot_module_t *m = &_modules[i];
+        uint32_t offset = m->phys & 0xFFF;
+        uint32_t pages = roundPageAligned(offset + m->size) / PAGE_SIZE;
+        if (pages == 0)
+            continue;
+
+        uint8_t *virt = vMapPhysical(m->phys, pages, BIT_PD_PT_PRESENT);
+        if (!virt) {
+            printf("Module %s: no room to map it\n", m->name);
+            continue;
+        }
+        vNameRegion(virt, pages, m->name);
+        m->data = virt + offset;
+        printf("Module %s: %d KiB at 0x%x\n", m->name, roundPageAligned(m->size) / 1024, m->data);
+    }
+}
+
+/**
+ * Find a module by name.
+ * 
+ * @param name Its name (the file name, see moduleName()).
+ * 
+ * @return The module or null.
+ */
+boot_module_t *findModule(const char *name) {
+    uint32_t i;
+
+    for (i = 0; i < _nModules; i++)
+        if (strcmp(_modules[i].name, name) == 0)
+            return &_modules[i];
+    return NULL;
+}
@@ -1,10 +1,23 @@
 #include <mm/pmm.h>
+#include <mm/pmm_backend.h>
+#include <mm/vmm.h>
+
+#include <common/utility.h>
+
+#include <interrupts/interrupt.h>
+
 #include <debug_utils/printf.h>
 
-bool pushAllPMM(free_mem_t m, bool merge);
-free_mem_t popAllPMM();
+pmm_cache_t _caches[PMM_CPUS];     ///< Frame caches, one for each CPU
+
+uint32_t _zeroPool[PMM_ZERO_POOL];  ///< Free frames that are already zeroed (stack)
+uint32_t _zeroPoolCount;            ///< Frames in _zeroPool
 
-bool defrag = false;
+uint32_t _zoneStart[PMM_ZONES];
+uint32_t _zoneEnd[PMM_ZONES];
+uint32_t _zoneFreePages[PMM_ZONES];     ///< Free pages of each zone (like _freePages)
+uint32_t _zoneFallback[PMM_ZONES] = { ZONE_NORMAL, ZONE_HIGH, ZONE_DMA };   ///< Order to try the zones in
+const char *_zoneNames[PMM_ZONES] = { "DMA", "Normal", "High" };
 
 /**
  * Get and anylize the GRUB memory map to count the RAM size.
@@ -34,267 +47,439 @@ uint32_t findRAMSize(multiboot_info_t* mbt) {
         }
     }
 
-    /**
-     * Finds the worst case scenario for the _stack (for a 4GB RAM == 8MB).
-     * 
-     * I need to find the number (so the dimension) of the possible entries on the stack.
-     * Then I divide it in half to preserve some memory. When it is reached, defrag is going to be used.
-     */
-    if (size > 0)
-        _halfMaxStack = roundPageAligned(((size * 1024) / PAGE_SIZE) * (sizeof(free_mem_t)) / 2);   
-
     return size;
 }
 
+/**
+ * Walk the GRUB memory map to find the end of the highest available region.
+ * The backend needs to keep track of every frame up to there, holes included.
+ * 
+ * @param mbt The physical address of GRUB's multiboot structure
+ * @return Number of frames to describe.
+ */
+uint32_t findTopFrame(multiboot_info_t* mbt) {
+    uint64_t top = 0;
+    memory_map_t *mmap = mbt->mmap_addr;
 
-bool mergePMM(free_mem_t toMerge) {
-    free_mem_t m = popAllPMM();
+    while ((uint32_t)mmap < (mbt->mmap_addr + mbt->mmap_length)) {
+        // Only what is usable and below 4GB
+        if (mmap->type == 0x1 && mmap->base_addr_high == 0) {
+            uint64_t regionEnd = (uint64_t)mmap->base_addr_low + mmap->length_low;
+            if (regionEnd > top)
+                top = regionEnd;
+        }
 
-    // Invalid
-    if (m.addr == 0x0 && m.nContiguousPages == 0x0)
-        return false;
+        mmap = (memory_map_t *)((uint32_t)mmap + mmap->size + sizeof(mmap->size));
+    }
 
-    if ((uint32_t)toMerge.addr == ((uint32_t)m.addr + (m.nContiguousPages * PAGE_SIZE))) {
-        // toMerge is after
-//        printf("newM-PUSHING-AFTER: m.addr = 0x%x; m.pages = %d\n", m.addr, m.nContiguousPages);
-        m.nContiguousPages += toMerge.nContiguousPages;
-        //merged = true;
-//        printf("newM-PUSHING-AFTER: m.addr = 0x%x; m.pages = %d\n", m.addr, m.nContiguousPages);
-        pushAllPMM(m, false);
-        return true;
-    } else if ((uint32_t)m.addr == ((uint32_t)toMerge.addr + (toMerge.nContiguousPages * PAGE_SIZE))) {
-        // toMerge is before
-//        printf("newM-PUSHING-BEFORE: m.addr = 0x%x; m.pages = %d\n", m.addr, m.nContiguousPages);
-        m.addr = toMerge.addr;
-        m.nContiguousPages += toMerge.nContiguousPages;
-//printf("newM-PUSHING-BEFORE: m.addr = 0x%x; m.pages = %d\n", m.addr, m.nContiguousPages);
-        pushAllPMM(m, false);
-        return true;
-    } else {
-//        printf("newM-REMERGE: toMerge.addr = 0x%x; toMerge.pages = %d\n", toMerge.addr, toMerge.nContiguousPages);
-        bool ret = mergePMM(toMerge);
-//        printf("newM-PUSHING: m.addr = 0x%x; m.pages = %d\n", m.addr, m.nContiguousPages);
-        pushAllPMM(m, false);
-        return ret;
+    if (top > 0x100000000ULL)
+        top = 0x100000000ULL;
+
+    return (uint32_t)(top / PAGE_SIZE);
+}
+
+/**
+ * Set the boundaries of the zones, clipped to the frames the PMM keeps track of.
+ */
+void initZonesPMM() {
+    uint32_t limits[PMM_ZONES] = { PMM_DMA_LIMIT / PAGE_SIZE, PMM_NORMAL_LIMIT / PAGE_SIZE, _nFrames };
+    uint32_t z, frame = 0;
+
+    for (z = 0; z < PMM_ZONES; z++) {
+        _zoneStart[z] = frame;
+        _zoneFreePages[z] = 0;
+        _zoneEnd[z] = limits[z] < _nFrames ? limits[z] : _nFrames;
+        if (_zoneEnd[z] < _zoneStart[z])
+            _zoneEnd[z] = _zoneStart[z];
+        frame = _zoneEnd[z];
     }
 }
 
 /**
- * \brief This function is going to check for every struct, if it is possible to merge with other.
- *
- * This algorithm has O(n^2) (I think?) so be careful when to call it.
- * For now it is called when the _stack is half the dimension of the worst case scenario.
- * Choices are:
- *      1. when you call free() (when you push to the free _stack)
- *      2. when the _stack size reaches its limit (4Mb sounds reasonable on a 4G machine)
- *      3. whenever you schedule the idle task
- * 
- * @param original Being a recursive function, it needs to know if it is the first call (true) or not.
- */
-void defragmentPMM(bool original) {
-    printf("defrag\n");
-    /*free_mem_t *outer_stack = _stack - sizeof(free_mem_t *); // _stack points to the next entry
-    free_mem_t *inner_stack = outer_stack - sizeof(free_mem_t *);    // Starts a struct after outer_stack
-    */
-    free_mem_t m;
-    do {
-        m = popAllPMM();
-        //mergePMM(m);
-
-        if (!mergePMM(m)) {
-            // Couldn't merge - Try the next entry
-            defragmentPMM(false);
-        } else if (!(m.addr == 0x0 && m.nContiguousPages == 0x0)) {
-            // Merged - Have to check all the _stack again
-            // If it is the first call - check the _stack, otherwise push
-            if (!original)
-                pushAllPMM(m, false);
-            else    
-                defragmentPMM(true);
-        }
-            
+ * Find the zone a frame belongs to.
+ */
+uint32_t zoneOfFrame(uint32_t frame) {
+    if (frame < _zoneEnd[ZONE_DMA])
+        return ZONE_DMA;
+    if (frame < _zoneEnd[ZONE_NORMAL])
+        return ZONE_NORMAL;
+    return ZONE_HIGH;
+}
 
-    } while(m.addr == 0x0 && m.nContiguousPages == 0x0);
-    defrag = true;
-    /*free_mem_t m;
+/**
+ * Set the descriptors of a run of frames.
+ * 
+ * @param frame First frame of the run.
+ * @param count Number of frames.
+ * @param flags PAGE_USED, PAGE_RESERVED or nothing for free frames.
+ * @param owner PAGE_OWNER_*.
+ */
+void setPages(uint32_t frame, uint32_t count, uint16_t flags, uint8_t owner) {
+    uint32_t i;
+
+    for (i = frame; i < frame + count; i++) {
+        _pages[i].flags = flags;
+        _pages[i].order = 0;
+        _pages[i].owner = owner;
+        _pages[i].refcount = (flags & PAGE_USED) ? 1 : 0;
+        _pages[i].mapped = 0;
+    }
+}
 
-    // Foreach element of the _stack
-    while ((m = popAllPMM()) == true) {//outer_stack > (free_mem_t *)&end) {       
-         = popAllPMM();
-        
-        if (!mergePMM(m))
-
-         Foreach other element of the _stack 
-        while (inner_stack > (free_mem_t *)&end) {
-            // Check if it is mergeble
-            if (inner_stack->addr == (m.addr + (m.nContiguousPages * PAGE_SIZE))) {
-                inner_stack->addr = m.addr;
-                inner_stack->nContiguousPages += m.nContiguousPages;
-
-                _stack -= sizeof(free_mem_t *);
-                break;
-
-            } else if (m.addr == (inner_stack->addr + (m.nContiguousPages * PAGE_SIZE))) {
-                inner_stack->nContiguousPages += m.nContiguousPages;
-                _stack -= sizeof(free_mem_t *);
-                break;
-            }
+/**
+ * Smallest order such that 2^order >= count.
+ */
+uint8_t pageOrder(uint32_t count) {
+    uint8_t order = 0;
+    while ((1u << order) < count)
+        order++;
+    return order;
+}
 
-            inner_stack -= sizeof(free_mem_t *);
-        }
+/**
+ * Give a run of frames to the backend, clipped to the frames it keeps track of 
+ * and split where it crosses a zone boundary. Their descriptors are reset to free.
+ * 
+ * @param frame First frame of the run.
+ * @param count Number of frames.
+ * 
+ * @return If something has been freed.
+ */
+bool freeFrames(uint32_t frame, uint32_t count) {
+    if (count == 0 || frame >= _nFrames)
+        return false;
+    if (count > _nFrames - frame)
+        count = _nFrames - frame;
+
+    uint32_t eflags = interrupt_save_disable();
+    _freePages += count;
+    setPages(frame, count, 0, PAGE_OWNER_NONE);
+
+    while (count > 0) {
+        uint32_t zone = zoneOfFrame(frame);
+        uint32_t n = _zoneEnd[zone] - frame;
+        if (n > count)
+            n = count;
+
+        freeFramesPMM(frame, n, zone);
+        _zoneFreePages[zone] += n;
+        frame += n;
+        count -= n;
+    }
 
-        outer_stack -= sizeof(free_mem_t *);
-    }*/
+    interrupt_restore(eflags);
+    return true;
 }
 
 /**
- * Insert in sorted order.
+ * Get contiguous frames from the first zone of the mask that has them.
+ * Must be called with interrupts disabled.
  * 
- * @param m Struct to push.
+ * @param count Number of frames.
+ * @param flags Zone mask.
+ * @return The first frame or PMM_NO_FRAME.
  */
-void sortedInsertPMM(free_mem_t m) {
-    // If empty or m is greater than the top address
-    if (_stack == (free_mem_t *)&end || (m.addr > (_stack - sizeof(free_mem_t *))->addr && (_stack - sizeof(free_mem_t *)) > (free_mem_t *)&end)) {
-        pushAllPMM(m, false);
-        return;
-    }
+uint32_t allocFromZones(uint32_t count, uint32_t flags) {
+    uint32_t i;
 
-    // Otherwise remove the top item and order
-    free_mem_t tmp = popAllPMM();
-    sortedInsertPMM(m);
+    for (i = 0; i < PMM_ZONES; i++) {
+        uint32_t zone = _zoneFallback[i];
+        if (!(flags & (1 << zone)))
+            continue;
 
-    // Push it back
-    pushAllPMM(tmp, false);
+        uint32_t frame = allocFramesPMM(count, zone);
+        if (frame != PMM_NO_FRAME)
+            return frame;
+    }
+    return PMM_NO_FRAME;
 }
 
 /**
- * Recursive function that sorts the _stack.
+ * Get contiguous frames from the backend.
+ * 
+ * @param count Number of frames.
+ * @param flags Zone mask.
+ * @return The first frame or PMM_NO_FRAME.
  */
-void sortPMM() {
-    if(_stack > (free_mem_t *)&end) {
-        free_mem_t tmp = popAllPMM();
-
-        sortPMM();
-        sortedInsertPMM(tmp);
+uint32_t allocFrames(uint32_t count, uint32_t flags) {
+    uint32_t eflags = interrupt_save_disable();
+    uint32_t frame = allocFromZones(count, flags);
+    if (frame != PMM_NO_FRAME) {
+        _freePages -= count;
+        _zoneFreePages[zoneOfFrame(frame)] -= count;
+        setPages(frame, count, PAGE_USED, PAGE_OWNER_KERNEL);
+        _pages[frame].order = pageOrder(count);
     }
+    interrupt_restore(eflags);
+    return frame;
 }
 
 /**
- * This function pushes a struct of address + nContiguousPages onto the _stack.
- * The _stack must be ordered from the bigger address (on top) to the smaller.
+ * The cache of the CPU we're running on.
+ * There is only one CPU for now.
+ */
+pmm_cache_t *currentCachePMM() {
+    return &_caches[0];
+}
+
+/**
+ * Fill a cache with a batch of frames taken from the backend (from any zone, DMA last).
+ * Must be called with interrupts disabled.
  * 
- * @param m Struct to push.
- * @param merge If it needs to be merged.
+ * @param cache The cache to refill.
+ */
+void refillCachePMM(pmm_cache_t *cache) {
+    while (cache->count < PMM_CACHE_BATCH) {
+        uint32_t frame = allocFromZones(1, PMM_ZONE_ANY);
+        if (frame == PMM_NO_FRAME)
+            break;
+        cache->frames[cache->count++] = frame;
+    }
+}
+
+/**
+ * Give a batch of frames of a cache back to the backend.
+ * Must be called with interrupts disabled.
  * 
- * @return True if it's all OK.
+ * @param cache The cache to drain.
+ * @param count How many frames.
  */
-bool pushAllPMM(free_mem_t m, bool merge) {
-    bool merged = false;
+void drainCachePMM(pmm_cache_t *cache, uint32_t count) {
+    while (count > 0 && cache->count > 0) {
+        uint32_t frame = cache->frames[--cache->count];
+        freeFramesPMM(frame, 1, zoneOfFrame(frame));
+        count--;
+    }
+}
 
-    if (merge)
-        merged = mergePMM(m);
+/**
+ * Give every cached frame back to the backend (the pre-zeroed ones too), 
+ * so it can merge them again for contiguous allocations.
+ */
+void drainCachesPMM() {
+    uint32_t eflags = interrupt_save_disable();
 
-    // If it wasn't merged, insert it but in order
-    if (!merged) {
-        // Time to push
-        *_stack = m;
-        _stack += sizeof(free_mem_t);
+    uint32_t i;
+    for (i = 0; i < PMM_CPUS; i++)
+        drainCachePMM(&_caches[i], PMM_CACHE_SIZE);
 
-        // A temporary _stack would be better :'(
-        if (merge)
-            sortPMM();
+    while (_zeroPoolCount > 0) {
+        uint32_t frame = _zeroPool[--_zeroPoolCount];
+        freeFramesPMM(frame, 1, zoneOfFrame(frame));
     }
 
-    if (_stack == (free_mem_t *)(&end + _halfMaxStack))
-        defragmentPMM(true);
+    interrupt_restore(eflags);
+}
 
+/**
+ * Zero a frame through the temporary window of the VMM.
+ * 
+ * @param frame The frame.
+ * @return If it was zeroed (false if the window couldn't be mapped).
+ */
+bool zeroFrame(uint32_t frame) {
+    uint32_t eflags = interrupt_save_disable();
+
+    void *page = vMapTemp(frame * PAGE_SIZE);
+    if (!page) {
+        interrupt_restore(eflags);
+        printf("PMM: can't map frame 0x%x to zero it\n", frame * PAGE_SIZE);
+        return false;
+    }
+    memsetl(page, 0, PAGE_SIZE / sizeof(uint32_t));
+    vUnmapTemp();
+
+    interrupt_restore(eflags);
     return true;
 }
 
 /**
- * This function pops the first struct of address + nContiguousPages off the _stack.
+ * Take a frame out of the pre-zeroed pool, if there is one in the zones of the mask.
  * 
- * @return The popped stack.
+ * @param flags Zone mask.
+ * @return The frame or PMM_NO_FRAME.
  */
-free_mem_t popAllPMM() {
-    _stack -= sizeof(free_mem_t);
+uint32_t takeZeroedPMM(uint32_t flags) {
+    uint32_t frame = PMM_NO_FRAME;
+    uint32_t eflags = interrupt_save_disable();
+
+    uint32_t i = _zeroPoolCount;
+    while (i-- > 0) {
+        if (flags & (1 << zoneOfFrame(_zeroPool[i]))) {
+            frame = _zeroPool[i];
+            _zeroPool[i] = _zeroPool[--_zeroPoolCount];
+            setPages(frame, 1, PAGE_USED, PAGE_OWNER_KERNEL);
+            _freePages--;
+            _zoneFreePages[zoneOfFrame(frame)]--;
+            break;
+        }
+    }
 
-    if (_stack < (free_mem_t *)&end) {
-        // Base _stack pointer
-        _stack = (free_mem_t *)&end;
+    interrupt_restore(eflags);
+    return frame;
+}
 
-        free_mem_t m;
-        m.addr = NULL;
-        m.nContiguousPages = NULL;
-        return m;
+/**
+ * Interface Function.
+ * 
+ * Idle work: zero one free frame and put it in the pre-zeroed pool, 
+ * so PMM_ZERO allocations don't have to wait for a memset.
+ * One frame at a time, so whoever calls it (the idle loop) can stop as soon as there is something better to do.
+ * 
+ * @return If a frame was zeroed (false when the pool is full or there is no free memory).
+ */
+bool zeroIdlePMM() {
+    if (_zeroPoolCount >= PMM_ZERO_POOL)
+        return false;
+
+    uint32_t addr = pAllocPage();
+    if (!addr)
+        return false;
+    if (!zeroFrame(addr / PAGE_SIZE)) {
+        pFreePage(addr);
+        return false;
+    }
+
+    uint32_t eflags = interrupt_save_disable();
+    if (_zeroPoolCount < PMM_ZERO_POOL) {
+        setPages(addr / PAGE_SIZE, 1, 0, PAGE_OWNER_NONE);
+        _zeroPool[_zeroPoolCount++] = addr / PAGE_SIZE;
+        _freePages++;
+        _zoneFreePages[zoneOfFrame(addr / PAGE_SIZE)]++;
     } else
-        // Return the value
-        return *_stack;
+        pFreePage(addr);
+    interrupt_restore(eflags);
+
+    return true;
+}
+
+/**
+ * Push a run of free pages found in the memory map to the backend.
+ * 
+ * @param m The run: first address and number of pages.
+ */
+void freeRunPMM(free_mem_t m) {
+    freeFrames((uint32_t)m.addr / PAGE_SIZE, m.nContiguousPages);
 }
 
 /**
  * Interface Function.
  * 
  * This function allocates a page (WILL BE 4K ALIGNED) and returns the address.
+ * It is taken from the cache of the CPU, which is refilled in batches when empty.
  * 
- * @see popAllPMM()
- * @see pushAllPMM()
+ * @see refillCachePMM()
  * 
  * @return Address of the now allocated 4KB-aligned page.
  */
 uint32_t pAllocPage() {
-    free_mem_t m = popAllPMM();
+    uint32_t eflags = interrupt_save_disable();
+    pmm_cache_t *cache = currentCachePMM();
     uint32_t addr = NULL;
 
-    if (m.nContiguousPages == 1) {
-        return m.addr;
-    } else if (m.nContiguousPages > 1) {
-        addr = m.addr;
-
-        m.addr = addr + PAGE_SIZE;
-        m.nContiguousPages--;
-
-        pushAllPMM(m, true);
-        return addr;
+    if (cache->count == 0)
+        refillCachePMM(cache);
+    if (cache->count == 0 && _zeroPoolCount > 0) {
+        // Last resort, the pre-zeroed frames
+        cache->frames[cache->count++] = _zeroPool[--_zeroPoolCount];
+    }
+    if (cache->count > 0) {
+        uint32_t frame = cache->frames[--cache->count];
+        setPages(frame, 1, PAGE_USED, PAGE_OWNER_KERNEL);
+        addr = frame * PAGE_SIZE;
+        _freePages--;
+        _zoneFreePages[zoneOfFrame(frame)]--;
     }
 
+    interrupt_restore(eflags);
     return addr;
 }
 
 /**
  * Interface Function.
  * 
- * This function frees a page, returning true or false if it finished well.
+ * This function drops a reference to a page, returning true or false if it finished well.
+ * Freeing a page that isn't allocated (i.e. a double free) fails.
+ * 
+ * When the last reference is gone the page goes in the cache of the CPU, which is drained in batches when full.
+ * DMA frames go straight back to the backend, so they don't end up in normal allocations.
  * 
- * @see pushAllPMM()
+ * @see drainCachePMM()
+ * @see pRefPage()
  * 
  * @param addr Address of the page to be freed.
  * 
  * @return If everything is OK.
  */
 bool pFreePage(void *addr) {
-    free_mem_t m;
+    uint32_t frame = (uint32_t)addr / PAGE_SIZE;
+    if (frame >= _nFrames)
+        return false;
+
+    uint32_t eflags = interrupt_save_disable();
+    page_t *page = &_pages[frame];
+
+    if (!(page->flags & PAGE_USED)) {
+        interrupt_restore(eflags);
+        printf("PMM: freeing 0x%x, which isn't allocated\n", addr);
+        return false;
+    }
+    if (--page->refcount > 0) {
+        // Still used by someone else
+        interrupt_restore(eflags);
+        return true;
+    }
+    if (zoneOfFrame(frame) == ZONE_DMA) {
+        freeFrames(frame, 1);
+        interrupt_restore(eflags);
+        return true;
+    }
 
-    m.addr = (uint32_t)addr & 0xFFFFF000;
-    m.nContiguousPages = 1;
+    setPages(frame, 1, 0, PAGE_OWNER_NONE);
+    pmm_cache_t *cache = currentCachePMM();
 
-    return pushAllPMM(m, true);
+    if (cache->count == PMM_CACHE_SIZE)
+        drainCachePMM(cache, PMM_CACHE_BATCH);
+    cache->frames[cache->count++] = frame;
+    _freePages++;
+    _zoneFreePages[zoneOfFrame(frame)]++;
+
+    interrupt_restore(eflags);
+    return true;
 }
 
 /**
- * Uses a kind-of First-Fit recursive technique.
+ * Interface Function.
+ * 
+ * This function gives the descriptor of the frame at a physical address.
+ * 
+ * @param addr Physical address.
+ * @return The descriptor or NULL if the PMM doesn't keep track of that frame.
  */
-free_mem_t firstFit(uint32_t size) {
-    free_mem_t m = popAllPMM();
+page_t *pGetPage(void *addr) {
+    uint32_t frame = (uint32_t)addr / PAGE_SIZE;
+    return frame < _nFrames ? &_pages[frame] : NULL;
+}
 
-    // The right one or Invalid
-    if ((m.nContiguousPages * PAGE_SIZE > size) || (m.addr == NULL && m.nContiguousPages == (int)NULL))
-        return m;
+/**
+ * Interface Function.
+ * 
+ * This function takes another reference to an allocated page (e.g. to map it a second time).
+ * Every reference is dropped with pFreePage().
+ * 
+ * @param addr Physical address of the page.
+ * @return The new number of references or 0 if the page isn't allocated (or has too many of them already).
+ */
+uint32_t pRefPage(void *addr) {
+    page_t *page = pGetPage(addr);
+    uint32_t refcount = 0;
 
-    free_mem_t b = firstFit(size);
-    pushAllPMM(m, true);
+    uint32_t eflags = interrupt_save_disable();
+    if (page && (page->flags & PAGE_USED) && page->refcount < 0xFFFF)
+        refcount = ++page->refcount;
+    interrupt_restore(eflags);
 
-    return b;
+    return refcount;
 }
 
 /**
@@ -303,59 +488,114 @@ free_mem_t firstFit(uint32_t size) {
  * (i. e. for 315 Byte will return 4KB, while for 16387 Byte will return 20K)
  */
 uint32_t roundPageAligned(uint32_t n) {
-    uint32_t smaller = 0;
-    uint32_t bigger = PAGE_SIZE;
+    return (n + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+}
 
-    while (!(n > smaller && n < bigger)) {
-        
-        if (n == bigger)
-            return bigger;
-        else if (n == smaller)
-            return smaller;
-        
-        smaller += PAGE_SIZE;
-        bigger += PAGE_SIZE;
+/**
+ * Interface Function.
+ * 
+ * This function allocates a wanted size (NOT NUMBER OF PAGES - BYTES), from any zone.
+ * 
+ * @see pAllocPagesFlags()
+ * 
+ * @param size Wanted bytes to allocate contiguously.
+ * @return Pointer to the buffer.
+ */
+uint32_t pAllocPages(uint32_t size) {
+    return pAllocPagesFlags(size, PMM_ZONE_ANY);
+}
+
+/**
+ * Interface Function.
+ * 
+ * This function allocates a page from the zones in the mask 
+ * (e.g. PMM_ZONE_DMA for a buffer an ISA DMA controller has to reach).
+ * With PMM_ZERO the page is zeroed: it comes from the pre-zeroed pool, or it is zeroed now if the pool is empty 
+ * (if that can't be done the page is freed and there is no allocation).
+ * 
+ * @see pAllocPage()
+ * @see zeroIdlePMM()
+ * 
+ * @param flags Zone mask, plus PMM_ZERO.
+ * @return Address of the now allocated 4KB-aligned page.
+ */
+uint32_t pAllocPageFlags(uint32_t flags) {
+    if (flags & PMM_ZERO) {
+        uint32_t frame = takeZeroedPMM(flags);
+        if (frame != PMM_NO_FRAME)
+            return frame * PAGE_SIZE;
+        _zeroPoolMisses++;
+    }
+
+    // The per-CPU caches can have frames of any zone
+    if ((flags & PMM_ZONE_ANY) == PMM_ZONE_ANY) {
+        uint32_t addr = pAllocPage();
+        if (addr && (flags & PMM_ZERO) && !zeroFrame(addr / PAGE_SIZE)) {
+            pFreePage(addr);
+            return NULL;
+        }
+        return addr;
     }
-    return bigger;
+
+    return pAllocPagesFlags(PAGE_SIZE, flags);
 }
 
 /**
  * Interface Function.
  * 
- * This function allocates a wanted size (NOT NUMBER OF PAGES - BYTES).
- * It uses the technique called "First-Fit". It's faster but causes fragmentation. 
- * While pushing in the _stack there are various controls to merge and an "emergency" function when the _stack is too big, so we're safe.
+ * This function allocates a wanted size (NOT NUMBER OF PAGES - BYTES) from the zones in the mask.
+ * The backend finds the contiguous frames, trying the zones in order: normal, high, DMA. 
+ * If it can't, the frames sitting in the per-CPU caches are given back and it tries again.
+ * A failure with enough free pages in those zones (so because of fragmentation) is counted in _contiguousFailures.
+ * With PMM_ZERO every page is zeroed before returning, or everything is freed if one can't be.
  * 
  * @see pFreePage()
  * @see pFreePages()
  * @see pAllocPage()
  * 
  * @param size Wanted bytes to allocate contiguously.
+ * @param flags Zone mask, plus PMM_ZERO.
  * @return Pointer to the buffer.
  */
-uint32_t pAllocPages(uint32_t size) {
-    if (size <= 0)
+uint32_t pAllocPagesFlags(uint32_t size, uint32_t flags) {
+    if (size == 0)
         return NULL;
 
-    uint32_t alignedSize = roundPageAligned(size);
-
-    free_mem_t m = firstFit(alignedSize); 
-    uint32_t addr = m.addr;
-
-    m.addr = (uint32_t)addr + alignedSize;
-    m.nContiguousPages -= (alignedSize) / PAGE_SIZE;
+    uint32_t count = roundPageAligned(size) / PAGE_SIZE;
+    uint32_t frame = allocFrames(count, flags);
+    if (frame == PMM_NO_FRAME) {
+        drainCachesPMM();
+        frame = allocFrames(count, flags);
+    }
+    if (frame == PMM_NO_FRAME) {
+        // The memory is there (in the zones that were asked for), but not in one piece
+        uint32_t z, free = 0;
+        for (z = 0; z < PMM_ZONES; z++)
+            if (flags & (1 << z))
+                free += _zoneFreePages[z];
+        if (count <= free)
+            _contiguousFailures++;
+        return NULL;
+    }
 
-    // If it is valid
-    if (m.nContiguousPages > 0)
-        pushAllPMM(m, true);
+    if (flags & PMM_ZERO) {
+        uint32_t i;
+        for (i = frame; i < frame + count; i++)
+            if (!zeroFrame(i)) {
+                pFreePages(frame * PAGE_SIZE, count * PAGE_SIZE);
+                return NULL;
+            }
+    }
 
-    return addr;
+    return frame * PAGE_SIZE;
 }
 
 /**
  * Interface Function.
  * 
  * This function frees memory from the address addr for size.
+ * Like pFreePage(), it drops a reference to every page and only gives back the ones nobody else uses.
+ * If some page isn't allocated nothing is freed.
  * 
  * @see pFreePage()
  * @see pAllocPage()
@@ -367,15 +607,35 @@ uint32_t pAllocPages(uint32_t size) {
  * @return If everything's OK
  */
 bool pFreePages(void *addr, uint32_t size) {
-    free_mem_t m;
-    
-    if (size == 0)
+    uint32_t frame = (uint32_t)addr / PAGE_SIZE;
+    uint32_t count = roundPageAligned(size) / PAGE_SIZE;
+    uint32_t i, run = 0;
+
+    if (count == 0 || frame >= _nFrames || count > _nFrames - frame)
         return false;
 
-    m.addr = addr;
-    m.nContiguousPages = roundPageAligned(size) / PAGE_SIZE;
+    uint32_t eflags = interrupt_save_disable();
+    for (i = frame; i < frame + count; i++) {
+        if (!(_pages[i].flags & PAGE_USED)) {
+            interrupt_restore(eflags);
+            printf("PMM: freeing 0x%x, which isn't allocated\n", i * PAGE_SIZE);
+            return false;
+        }
+    }
 
-    return pushAllPMM(m, true);
+    // The pages that are left without references are freed a run at a time
+    for (i = frame; i < frame + count; i++) {
+        if (--_pages[i].refcount == 0) {
+            run++;
+            continue;
+        }
+        freeFrames(i - run, run);
+        run = 0;
+    }
+    freeFrames(frame + count - run, run);
+
+    interrupt_restore(eflags);
+    return true;
 }
 
 /**
@@ -403,7 +663,7 @@ bool checkPD (uint32_t pd_start, uint32_t pd_end, free_mem_t m) {
 
         // Push the part below
         m.nContiguousPages = (pd_start - (uint32_t)m.addr) / PAGE_SIZE;
-        pushAllPMM(m, true);
+        freeRunPMM(m);
 
         // Push the part above
         m.addr = pd_end;
@@ -411,7 +671,7 @@ bool checkPD (uint32_t pd_start, uint32_t pd_end, free_mem_t m) {
     } else 
         return false;
 
-    pushAllPMM(m, true);
+    freeRunPMM(m);
     return true;
 }
 
@@ -465,7 +725,7 @@ void checkBoundaries(uint32_t pd_start, uint32_t pd_end,  uint32_t length, uint3
         m.nContiguousPages = (_start_addr_phys - base_addr) / PAGE_SIZE;
         
         if (!checkPD(pd_start, pd_end, m))
-            pushAllPMM(m, true);
+            freeRunPMM(m);
 
         // Push the part above
         m.addr = _end_addr_phys;
@@ -473,18 +733,135 @@ void checkBoundaries(uint32_t pd_start, uint32_t pd_end,  uint32_t length, uint3
     }
 
     if (!checkPD(pd_start, pd_end, m))
-       pushAllPMM(m, true);
+       freeRunPMM(m);
+}
+
+/**
+ * The modules GRUB loaded (see modules.c), or null if there are none.
+ * Like the memory map, the list is read through the identity mapping of the boot page directory.
+ * 
+ * @param count Where to put the number of modules.
+ */
+module_t *modulesOf(multiboot_info_t *mbt, uint32_t *count) {
+    if (!(mbt->flags & 0x8) || mbt->mods_count == 0) {
+        *count = 0;
+        return NULL;
+    }
+    *count = mbt->mods_count;
+    return (module_t *)mbt->mods_addr;
+}
+
+/**
+ * The kernel can't go on without the PMM: stop here (whoever calls this has said why).
+ */
+void stopPMM() {
+    printf("PMM: can't go on, halting.\n");
+    for (;;)
+        __asm__ __volatile__("cli; hlt");
+}
+
+/**
+ * If a physical range is all inside a single free sector of GRUB's memory map.
+ */
+bool usableMemory(multiboot_info_t *mbt, uint32_t phys, uint32_t size) {
+    memory_map_t *mmap = mbt->mmap_addr;
+
+    while ((uint32_t)mmap < (mbt->mmap_addr + mbt->mmap_length)) {
+        if (mmap->type == 0x1 && phys >= mmap->base_addr_low && 
+            (uint64_t)phys + size <= (uint64_t)mmap->base_addr_low + mmap->length_low)
+            return true;
+        mmap = (memory_map_t *)((uint32_t)mmap + mmap->size + sizeof(mmap->size));
+    }
+    return false;
 }
 
 /**
- * \brief Creates a stack (run-length encoded) of free pages.
+ * Find where the PMM metadata goes: right after the kernel, unless that's where GRUB loaded a module 
+ * (it usually puts them right after the kernel): the modules are used in place, so the metadata goes after them.
+ * 
+ * Only the 4MB page of the kernel is mapped this early: if the metadata goes past it 
+ * (a lot of RAM, or big modules before it), the boot page directory gets more 4MB pages for it (see vMapBoot()). 
+ * If that's not possible the boot stops here, instead of faulting on the first write to the metadata, 
+ * saying which module pushed it there, if one did.
+ * 
+ * @param addr Virtual address right after the kernel.
+ * @param size Bytes of metadata.
+ * 
+ * @return The virtual address of the metadata.
+ */
+uint32_t placeMetadata(multiboot_info_t *mbt, uint32_t addr, uint32_t size) {
+    uint32_t count, i;
+    module_t *mods = modulesOf(mbt, &count);
+    module_t *pushedBy = NULL;
+    bool moved = true;
+
+    while (moved) {
+        moved = false;
+        for (i = 0; i < count; i++) {
+            uint32_t phys = addr - KERNEL_VIRTUAL_BASE;
+            if (mods[i].mod_start < phys + size && mods[i].mod_end > phys) {
+                addr = roundPageAligned(mods[i].mod_end) + KERNEL_VIRTUAL_BASE;
+                pushedBy = &mods[i];
+                moved = true;
+            }
+        }
+    }
+
+    if (addr + size > KERNEL_VIRTUAL_BASE + LARGE_PAGE_SIZE) {
+        bool ok = usableMemory(mbt, addr - KERNEL_VIRTUAL_BASE, size);
+        if (!ok)
+            printf("PMM: no free memory for the metadata at 0x%x - 0x%x\n", addr - KERNEL_VIRTUAL_BASE, addr + size - KERNEL_VIRTUAL_BASE);
+        else if (!(ok = vMapBoot(addr, size)))
+            printf("PMM: the metadata (%d KiB at 0x%x) can't be mapped\n", size / 1024, addr);
+
+        if (!ok) {
+            if (pushedBy)
+                printf("PMM: it goes after module %d (0x%x - 0x%x): it's too big, or GRUB loaded it too high\n", 
+                       pushedBy - mods, pushedBy->mod_start, pushedBy->mod_end);
+            stopPMM();
+        }
+    }
+    return addr;
+}
+
+/**
+ * Give a free sector of the memory map to the PMM, without the modules in it (they stay where GRUB put them, see modules.c). 
+ * The parts around each module go on to the next modules, and in the end to checkBoundaries().
+ * 
+ * @param pd The boot page directory.
+ * @param length Length of the free sector.
+ * @param base_addr Starting address of the free sector.
+ * @param mods The modules left to check.
+ * @param count How many they are.
+ */
+void freeAroundModules(uint32_t *pd, uint32_t length, uint32_t base_addr, module_t *mods, uint32_t count) {
+    uint32_t i;
+
+    for (i = 0; i < count; i++) {
+        uint32_t modStart = mods[i].mod_start & 0xFFFFF000;
+        uint32_t modEnd = roundPageAligned(mods[i].mod_end);
+        if (modStart >= base_addr + length || modEnd <= base_addr)
+            continue;
+
+        if (modStart > base_addr)
+            freeAroundModules(pd, modStart - base_addr, base_addr, mods + i + 1, count - i - 1);
+        if (modEnd < base_addr + length)
+            freeAroundModules(pd, base_addr + length - modEnd, modEnd, mods + i + 1, count - i - 1);
+        return;
+    }
+    checkBoundaries(pd, pd + 1024, length, base_addr);
+}
+
+/**
+ * \brief Keeps track of the free pages.
  * 
  * To implement the physical memory manager something to hold all the free addressed is needed.
- * I'm using a run-length encoded _stack: this technique constists in pushing the address and the number of pages all at once.
- * This has several advantages:
- *      1. it requires considerably less memory
- *      2. it's trivial to fill up the initial _stack from E820 data as it uses the same format :-)
- *      3. you can search for entries with more pages if you really want to allocate contiguous physical pages
+ * That's the job of the backend, chosen at build time (PMM_BACKEND in the Makefile):
+ *      - buddy: free lists of 2^order pages, O(log n) allocations and frees (pmm_buddy.c)
+ *      - bitmap: 1 bit for each frame, searched a word at a time (pmm_bitmap.c)
+ *      - extent: runs of free frames in a tree ordered by address, merged as soon as they are freed (pmm_extent.c)
+ * 
+ * Its metadata is placed right after the kernel (see placeMetadata()).
  * 
  * At this moment the real page size is 4MB still, 
  * but in the initialization of the Virtual Memory Manager it's gonna switch to 4KB.
@@ -498,19 +875,37 @@ void init_pmm(multiboot_info_t* mbt, uint32_t *pd) {
         return;
     }
 
-    _halfMaxStack = 0;
     _RAMSize = findRAMSize(mbt);
     printf("Total RAM size: %d KiB\n", _RAMSize);
 
-    // Set the start of the _stack
-    _stack = roundPageAligned((free_mem_t *)&end);
+    // Set up the backend right after the kernel, every frame starts as used
+    _freePages = 0;
+    _contiguousFailures = 0;
+    _zeroPoolMisses = 0;
+    _zeroPoolCount = 0;
+    _nFrames = findTopFrame(mbt);
+    initZonesPMM();
+
+    uint32_t backendSize = roundPageAligned(metadataSizePMM(_nFrames));
+    _pmmMetadataSize = backendSize + roundPageAligned(_nFrames * sizeof(page_t));
+    _pmmMetadataStart = placeMetadata(mbt, roundPageAligned((uint32_t)&end), _pmmMetadataSize);
+    initFramesPMM(_pmmMetadataStart, _nFrames);
+    printf("PMM backend: %s (%d KiB of metadata)\n", pmmBackendName, backendSize / 1024);
+
+    // Every frame is reserved until the memory map says otherwise
+    _pages = _pmmMetadataStart + backendSize;
+    setPages(0, _nFrames, PAGE_RESERVED, PAGE_OWNER_NONE);
+    printf("Page descriptors: %d KiB\n", (_pmmMetadataSize - backendSize) / 1024);
+
     _start_addr_phys = (uint32_t)((&start) - KERNEL_VIRTUAL_BASE) & 0xFFFFF000;
-    _end_addr_phys = roundPageAligned((uint32_t)&end + _halfMaxStack - KERNEL_VIRTUAL_BASE);
+    _end_addr_phys = roundPageAligned(_pmmMetadataStart + _pmmMetadataSize - KERNEL_VIRTUAL_BASE);
 
     // Find out what addresses are free
     memory_map_t *mmap = mbt->mmap_addr;
+    uint32_t nModules;
+    module_t *mods = modulesOf(mbt, &nModules);
 
-    // Gonna push every free block if it isn't in the kernel + _stack space
+    // Gonna free every block if it isn't in the kernel + metadata space (or in a module)
     while ((uint32_t)mmap < (mbt->mmap_addr + mbt->mmap_length)) {
         /**
          * If the memory sector is not reserved or the address is below 1MB, exclude it.
@@ -518,11 +913,15 @@ void init_pmm(multiboot_info_t* mbt, uint32_t *pd) {
          */
         if (mmap->type == 0x1) {
             if(mmap->base_addr_low >= 0x100000)
-                checkBoundaries(pd, pd + 1024, mmap->length_low, mmap->base_addr_low);
+                freeAroundModules(pd, mmap->length_low, mmap->base_addr_low, mods, nModules);
             if (mmap->base_addr_high >= 0x100000)
-                checkBoundaries(pd, pd + 1024, mmap->length_high, mmap->base_addr_high);
+                freeAroundModules(pd, mmap->length_high, mmap->base_addr_high, mods, nModules);
         }
 
         mmap = (memory_map_t *)((uint32_t)mmap + mmap->size + sizeof(mmap->size));
     }
+
+    uint32_t z;
+    for (z = 0; z < PMM_ZONES; z++)
+        printf("Zone %s: %d KiB\n", _zoneNames[z], (_zoneEnd[z] - _zoneStart[z]) * (PAGE_SIZE / 1024));
 }
\ No newline at end of file
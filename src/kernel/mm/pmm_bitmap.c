@@ -0,0 +1,210 @@
+#include <mm/pmm.h>
+#include <mm/pmm_backend.h>
+
+#include <common/utility.h>
+
+/**
+ * \brief Bitmap backend of the PMM.
+ * 
+ * One bit for each frame (set = used), so 128KB are enough for 4GB of RAM.
+ * On top of it there is a summary level: one bit for each word of the bitmap, set when the word is full.
+ * To find a free frame, the first summary word that isn't full tells which bitmap word to look at, 
+ * and a bsf (__builtin_ctz) on both gives the frame without looking at single bits.
+ * 
+ * A summary word covers 1024 frames (4MB) and the zone boundaries are 4MB aligned,
+ * so every zone is a range of summary words and has its own hint.
+ */
+
+#define BITS 32
+
+const char *pmmBackendName = "bitmap";
+
+uint32_t *_bitmap;          ///< 1 bit for each frame, set if used
+uint32_t *_summary;         ///< 1 bit for each word of _bitmap, set if the word is full
+uint32_t _bitmapWords;      ///< Words in _bitmap
+uint32_t _summaryWords;     ///< Words in _summary
+uint32_t _summaryHint[PMM_ZONES];  ///< No summary word of the zone below this one has a free frame
+
+/**
+ * Update the summary bit of a word of the bitmap.
+ * 
+ * @param word Index of the word in _bitmap.
+ */
+void updateSummary(uint32_t word) {
+    if (_bitmap[word] == 0xFFFFFFFF)
+        _summary[word / BITS] |= (1 << (word % BITS));
+    else {
+        _summary[word / BITS] &= ~(1 << (word % BITS));
+
+        uint32_t zone = zoneOfFrame(word * BITS);
+        if (word / BITS < _summaryHint[zone])
+            _summaryHint[zone] = word / BITS;
+    }
+}
+
+/**
+ * Set (used) or clear (free) a run of bits, a word at a time.
+ * 
+ * @param frame First frame.
+ * @param count Number of frames.
+ * @param used What to set.
+ */
+void markFrames(uint32_t frame, uint32_t count, bool used) {
+    while (count > 0) {
+        uint32_t word = frame / BITS;
+        uint32_t bit = frame % BITS;
+        uint32_t n = BITS - bit;
+        if (n > count)
+            n = count;
+
+        uint32_t mask = (n == BITS) ? 0xFFFFFFFF : (((1u << n) - 1) << bit);
+        if (used)
+            _bitmap[word] |= mask;
+        else
+            _bitmap[word] &= ~mask;
+        updateSummary(word);
+
+        frame += n;
+        count -= n;
+    }
+}
+
+/**
+ * Find the first free frame starting from a given one, without going past a limit.
+ * Full words are skipped looking at the summary.
+ * 
+ * @param frame Where to start.
+ * @param limit Where to stop.
+ * @return The free frame or PMM_NO_FRAME.
+ */
+uint32_t nextFreeFrame(uint32_t frame, uint32_t limit) {
+    uint32_t word = frame / BITS;
+    uint32_t found = PMM_NO_FRAME;
+
+    if (frame >= limit || word >= _bitmapWords)
+        return PMM_NO_FRAME;
+
+    // The rest of the first word
+    uint32_t free = ~_bitmap[word] & (0xFFFFFFFF << (frame % BITS));
+    if (free)
+        found = word * BITS + __builtin_ctz(free);
+    else {
+        // Then the first word that isn't full
+        word++;
+        uint32_t s = word / BITS;
+        while (s < _summaryWords && s * BITS * BITS < limit) {
+            uint32_t notFull = ~_summary[s];
+            if (s == word / BITS)
+                notFull &= 0xFFFFFFFF << (word % BITS);
+
+            if (notFull) {
+                word = s * BITS + __builtin_ctz(notFull);
+                if (word < _bitmapWords)
+                    found = word * BITS + __builtin_ctz(~_bitmap[word]);
+                break;
+            }
+            s++;
+        }
+    }
+
+    return found < limit ? found : PMM_NO_FRAME;
+}
+
+/**
+ * Find the first used frame starting from a given one, without going past a limit.
+ * 
+ * @param frame Where to start.
+ * @param limit Where to stop.
+ * @return The used frame or limit.
+ */
+uint32_t nextUsedFrame(uint32_t frame, uint32_t limit) {
+    while (frame < limit) {
+        uint32_t used = _bitmap[frame / BITS] & (0xFFFFFFFF << (frame % BITS));
+        if (used) {
+            frame = (frame & ~(BITS - 1)) + __builtin_ctz(used);
+            return frame < limit ? frame : limit;
+        }
+
+        // Empty word, next one
+        frame = (frame & ~(BITS - 1)) + BITS;
+    }
+    return limit;
+}
+
+/**
+ * Backend Function.
+ * 
+ * @param nFrames Number of frames to keep track of.
+ * @return Bytes needed for the bitmap and its summary.
+ */
+uint32_t metadataSizePMM(uint32_t nFrames) {
+    uint32_t words = (nFrames + BITS - 1) / BITS;
+    return (words + (words + BITS - 1) / BITS) * sizeof(uint32_t);
+}
+
+/**
+ * Backend Function.
+ * 
+ * Every frame starts as used, the free ones are added with freeFramesPMM().
+ * 
+ * @param metadata Where to put the bitmaps (metadataSizePMM() bytes).
+ * @param nFrames Number of frames to keep track of.
+ */
+void initFramesPMM(void *metadata, uint32_t nFrames) {
+    _bitmapWords = (nFrames + BITS - 1) / BITS;
+    _summaryWords = (_bitmapWords + BITS - 1) / BITS;
+    _bitmap = metadata;
+    _summary = _bitmap + _bitmapWords;
+
+    uint32_t z;
+    for (z = 0; z < PMM_ZONES; z++)
+        _summaryHint[z] = _summaryWords;
+
+    // All used (so the bits past nFrames never look free)
+    memset(_bitmap, 0xFF, metadataSizePMM(nFrames));
+}
+
+/**
+ * Backend Function.
+ * 
+ * Looks for the first run of free frames long enough: every time a run is too short, 
+ * the search restarts from the next free frame after it.
+ * 
+ * @param count Number of contiguous frames.
+ * @param zone Zone to take them from.
+ * @return The first frame or PMM_NO_FRAME.
+ */
+uint32_t allocFramesPMM(uint32_t count, uint32_t zone) {
+    uint32_t first = _zoneStart[zone] / (BITS * BITS);
+    uint32_t last = (_zoneEnd[zone] + BITS * BITS - 1) / (BITS * BITS);
+
+    if (_summaryHint[zone] < first)
+        _summaryHint[zone] = first;
+
+    // Skip the summary words that are full
+    while (_summaryHint[zone] < last && _summary[_summaryHint[zone]] == 0xFFFFFFFF)
+        _summaryHint[zone]++;
+
+    uint32_t frame = nextFreeFrame(_summaryHint[zone] * BITS * BITS, _zoneEnd[zone]);
+
+    while (frame != PMM_NO_FRAME && frame + count <= _zoneEnd[zone]) {
+        uint32_t used = nextUsedFrame(frame, frame + count);
+        if (used == frame + count) {
+            markFrames(frame, count, true);
+            return frame;
+        }
+        frame = nextFreeFrame(used, _zoneEnd[zone]);
+    }
+    return PMM_NO_FRAME;
+}
+
+/**
+ * Backend Function.
+ * 
+ * @param frame First frame of the run.
+ * @param count Number of frames.
+ * @param zone Zone of the run (the bitmap doesn't need it, every frame has its own bit).
+ */
+void freeFramesPMM(uint32_t frame, uint32_t count, __attribute__((unused)) uint32_t zone) {
+    markFrames(frame, count, false);
+}
@@ -0,0 +1,248 @@
+#include <mm/pmm.h>
+#include <mm/pmm_backend.h>
+
+#include <common/utility.h>
+
+/**
+ * \brief Binary buddy allocator backend of the PMM.
+ * 
+ * The free memory is kept in blocks of 2^order pages (from 4KB to 4MB), one free list for each order.
+ * This has several advantages:
+ *      1. allocating and freeing cost at most PMM_MAX_ORDER splits or merges, no matter how fragmented the memory is
+ *      2. a freed block finds its neighbour (the buddy) with a XOR, so coalescing is immediate
+ *      3. contiguous physical pages come for free, up to 4MB (more are found as 4MB blocks next to each other)
+ * 
+ * Each zone has its own free lists. The zone boundaries are 4MB aligned, so two buddies are always in the same zone.
+ */
+
+#define PMM_MAX_ORDER 10            ///< Biggest buddy block: 2^10 pages (4MB)
+
+/**
+ * The free blocks are in the page descriptors of the PMM (_pages), so the backend has no array of its own: 
+ * the first frame of a free block has PAGE_FREE_BLOCK, its order and the links of its free list.
+ */
+
+const char *pmmBackendName = "buddy";
+
+uint32_t _freeLists[PMM_ZONES][PMM_MAX_ORDER + 1];     ///< Heads of the free lists, one for each zone and order
+
+/**
+ * Take a block out of the free list of its order.
+ * 
+ * @param frame First frame of the block.
+ */
+void removeFreeBlock(uint32_t frame) {
+    page_t *b = &_pages[frame];
+
+    if (b->prev != PMM_NO_FRAME)
+        _pages[b->prev].next = b->next;
+    else
+        _freeLists[zoneOfFrame(frame)][b->order] = b->next;
+
+    if (b->next != PMM_NO_FRAME)
+        _pages[b->next].prev = b->prev;
+
+    b->flags &= ~PAGE_FREE_BLOCK;
+    b->next = 0;
+}
+
+/**
+ * Put a block on top of the free list of the given zone and order.
+ * 
+ * @param frame First frame of the block.
+ * @param order The block is 2^order pages.
+ * @param zone Zone of the block.
+ */
+void insertFreeBlock(uint32_t frame, uint32_t order, uint32_t zone) {
+    page_t *b = &_pages[frame];
+
+    b->order = order;
+    b->flags |= PAGE_FREE_BLOCK;
+    b->prev = PMM_NO_FRAME;
+    b->next = _freeLists[zone][order];
+
+    if (b->next != PMM_NO_FRAME)
+        _pages[b->next].prev = frame;
+    _freeLists[zone][order] = frame;
+}
+
+/**
+ * \brief Give back a block to the buddy allocator, merging it with its buddy as long as possible.
+ * 
+ * The buddy of a block of order k starts at frame ^ 2^k: if it is free and of the same order, 
+ * the two are merged in a block of order k + 1 and the check is repeated one level up.
+ * That's at most PMM_MAX_ORDER steps, no matter how fragmented the memory is.
+ * 
+ * @param frame First frame of the block.
+ * @param order The block is 2^order pages.
+ * @param zone Zone of the block.
+ */
+void freeBlock(uint32_t frame, uint32_t order, uint32_t zone) {
+    while (order < PMM_MAX_ORDER) {
+        uint32_t buddy = frame ^ (1 << order);
+
+        if (buddy >= _nFrames || !(_pages[buddy].flags & PAGE_FREE_BLOCK) || _pages[buddy].order != order)
+            break;
+
+        removeFreeBlock(buddy);
+        if (buddy < frame)
+            frame = buddy;
+        order++;
+    }
+
+    insertFreeBlock(frame, order, zone);
+}
+
+/**
+ * Get a block of 2^order pages, splitting a bigger one if needed.
+ * The halves that are not used go back to the lower free lists.
+ * 
+ * @param order The block is 2^order pages.
+ * @param zone Zone to take it from.
+ * @return The first frame of the block or PMM_NO_FRAME.
+ */
+uint32_t allocBlock(uint32_t order, uint32_t zone) {
+    uint32_t current = order;
+
+    // Smallest non-empty list that fits
+    while (current <= PMM_MAX_ORDER && _freeLists[zone][current] == PMM_NO_FRAME)
+        current++;
+
+    if (current > PMM_MAX_ORDER)
+        return PMM_NO_FRAME;
+
+    uint32_t frame = _freeLists[zone][current];
+    removeFreeBlock(frame);
+
+    while (current > order) {
+        current--;
+        insertFreeBlock(frame + (1 << current), current, zone);
+    }
+
+    _pages[frame].order = order;
+    return frame;
+}
+
+/**
+ * Get a run bigger than the biggest block: that many blocks of PMM_MAX_ORDER, one right after the other.
+ * Every free block of PMM_MAX_ORDER is tried as the first one, so it's O(free 4MB blocks * blocks needed), 
+ * but the runs that big are rare (and asked for at boot, usually).
+ * 
+ * @param blocks Number of blocks of PMM_MAX_ORDER.
+ * @param zone Zone to take them from.
+ * @return The first frame or PMM_NO_FRAME.
+ */
+uint32_t allocBlockRun(uint32_t blocks, uint32_t zone) {
+    uint32_t frame, i;
+
+    for (frame = _freeLists[zone][PMM_MAX_ORDER]; frame != PMM_NO_FRAME; frame = _pages[frame].next) {
+        for (i = 1; i < blocks; i++) {
+            uint32_t next = frame + (i << PMM_MAX_ORDER);
+            if (next >= _zoneEnd[zone] || !(_pages[next].flags & PAGE_FREE_BLOCK) || _pages[next].order != PMM_MAX_ORDER)
+                break;
+        }
+        if (i < blocks)
+            continue;
+
+        for (i = 0; i < blocks; i++)
+            removeFreeBlock(frame + (i << PMM_MAX_ORDER));
+        return frame;
+    }
+    return PMM_NO_FRAME;
+}
+
+/**
+ * From the number of pages to the smallest order that contains them.
+ */
+uint32_t orderOf(uint32_t pages) {
+    uint32_t order = 0;
+    while ((1u << order) < pages)
+        order++;
+    return order;
+}
+
+/**
+ * Backend Function.
+ * 
+ * @param nFrames Number of frames to keep track of.
+ * @return Bytes needed: none, the blocks are in the page descriptors.
+ */
+uint32_t metadataSizePMM(uint32_t nFrames) {
+    (void)nFrames;
+    return 0;
+}
+
+/**
+ * Backend Function.
+ * 
+ * Every frame starts as used, the free ones are added with freeFramesPMM().
+ * 
+ * @param metadata Nothing (metadataSizePMM() is 0).
+ * @param nFrames Number of frames to keep track of.
+ */
+void initFramesPMM(void *metadata, uint32_t nFrames) {
+    (void)metadata;
+    (void)nFrames;
+
+    uint32_t z, i;
+    for (z = 0; z < PMM_ZONES; z++)
+        for (i = 0; i <= PMM_MAX_ORDER; i++)
+            _freeLists[z][i] = PMM_NO_FRAME;
+}
+
+/**
+ * Backend Function.
+ * 
+ * Takes the smallest buddy block that contains the request and gives back the frames at the end that aren't needed, 
+ * so the caller gets exactly what it asked for. 
+ * More than 2^PMM_MAX_ORDER frames are a run of blocks of that order, next to each other (see allocBlockRun()).
+ * 
+ * @param count Number of contiguous frames.
+ * @param zone Zone to take them from.
+ * @return The first frame or PMM_NO_FRAME.
+ */
+uint32_t allocFramesPMM(uint32_t count, uint32_t zone) {
+    uint32_t order = orderOf(count);
+    uint32_t frame, got;
+
+    if (order > PMM_MAX_ORDER) {
+        // Bigger than the biggest block
+        uint32_t blocks = (count + (1 << PMM_MAX_ORDER) - 1) >> PMM_MAX_ORDER;
+        frame = allocBlockRun(blocks, zone);
+        got = blocks << PMM_MAX_ORDER;
+    } else {
+        frame = allocBlock(order, zone);
+        got = 1 << order;
+    }
+    if (frame == PMM_NO_FRAME)
+        return PMM_NO_FRAME;
+
+    // Give back the tail
+    if (got > count)
+        freeFramesPMM(frame + count, got - count, zone);
+
+    return frame;
+}
+
+/**
+ * Backend Function.
+ * 
+ * Free a run of frames of any length.
+ * It is split in the biggest naturally aligned blocks, each one merged with its buddies.
+ * 
+ * @param frame First frame of the run.
+ * @param count Number of frames.
+ * @param zone Zone of the run.
+ */
+void freeFramesPMM(uint32_t frame, uint32_t count, uint32_t zone) {
+    while (count > 0) {
+        uint32_t order = 0;
+        while (order < PMM_MAX_ORDER && 
+               (frame & ((2 << order) - 1)) == 0 && (2u << order) <= count)
+            order++;
+
+        freeBlock(frame, order, zone);
+        frame += (1 << order);
+        count -= (1 << order);
+    }
+}
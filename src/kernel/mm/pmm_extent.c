@@ -0,0 +1,357 @@
+#include <mm/pmm.h>
+#include <mm/pmm_backend.h>
+
+#include <common/utility.h>
+
+/**
+ * \brief Extent backend of the PMM.
+ * 
+ * It is the old run-length encoded stack (first frame + number of frames),
+ * but the runs are kept in an AVL tree ordered by address instead of a stack.
+ * When a run is freed, the run before and the run after are found in O(log n) and merged with it right away,
+ * so there is never anything to defragment: no two runs in the tree are ever adjacent.
+ * 
+ * The same runs are also in a second AVL tree ordered by size, 
+ * so the best fit for a contiguous request (the smallest run that is big enough) is found in O(log n) too.
+ * 
+ * Every zone has its own pair of trees, so a run never crosses a zone boundary.
+ * 
+ * The nodes are in a pool after the kernel: there can't be more than nFrames / 2 runs
+ * (two runs are always separated by at least a used frame), plus one for each zone boundary.
+ */
+
+#define NIL 0       ///< No node (node 0 is never used)
+
+#define BY_ADDR 0   ///< Tree of the runs ordered by address
+#define BY_SIZE 1   ///< Tree of the runs ordered by size (then address)
+
+/**
+ * Links of a node in one of the two trees.
+ */
+typedef struct extent_links {
+    uint32_t left;          ///< Lower key
+    uint32_t right;         ///< Higher key (or next node in the pool, if unused)
+    uint32_t height;        ///< Height of the subtree
+} extent_links_t;
+
+/**
+ * A run of free frames, in both trees.
+ */
+typedef struct extent {
+    uint32_t frame;             ///< First frame of the run
+    uint32_t count;             ///< Number of frames
+    extent_links_t link[2];     ///< BY_ADDR and BY_SIZE
+} extent_t;
+
+const char *pmmBackendName = "extent";
+
+extent_t *_extents;         ///< Pool of nodes
+uint32_t _extentRoot[PMM_ZONES][2];    ///< Roots of the trees of each zone
+uint32_t _extentPool;       ///< First unused node
+
+/**
+ * Take a node from the pool.
+ */
+uint32_t newExtent(uint32_t frame, uint32_t count) {
+    uint32_t n = _extentPool;
+    _extentPool = _extents[n].link[BY_ADDR].right;
+
+    memset(&_extents[n], 0, sizeof(extent_t));
+    _extents[n].frame = frame;
+    _extents[n].count = count;
+    _extents[n].link[BY_ADDR].height = 1;
+    _extents[n].link[BY_SIZE].height = 1;
+    return n;
+}
+
+/**
+ * Give a node back to the pool.
+ */
+void deleteExtentNode(uint32_t n) {
+    _extents[n].link[BY_ADDR].right = _extentPool;
+    _extentPool = n;
+}
+
+/**
+ * If the key of a is lower than the key of b in a tree.
+ */
+bool lessExtent(uint32_t a, uint32_t b, uint32_t tree) {
+    if (tree == BY_SIZE && _extents[a].count != _extents[b].count)
+        return _extents[a].count < _extents[b].count;
+    return _extents[a].frame < _extents[b].frame;
+}
+
+uint32_t heightOf(uint32_t n, uint32_t tree) {
+    return n == NIL ? 0 : _extents[n].link[tree].height;
+}
+
+/**
+ * Recalculate the height of a node from its children.
+ */
+void updateExtent(uint32_t n, uint32_t tree) {
+    extent_links_t *l = &_extents[n].link[tree];
+    uint32_t hl = heightOf(l->left, tree), hr = heightOf(l->right, tree);
+
+    l->height = 1 + (hl > hr ? hl : hr);
+}
+
+uint32_t rotateRight(uint32_t n, uint32_t tree) {
+    uint32_t l = _extents[n].link[tree].left;
+
+    _extents[n].link[tree].left = _extents[l].link[tree].right;
+    _extents[l].link[tree].right = n;
+    updateExtent(n, tree);
+    updateExtent(l, tree);
+    return l;
+}
+
+uint32_t rotateLeft(uint32_t n, uint32_t tree) {
+    uint32_t r = _extents[n].link[tree].right;
+
+    _extents[n].link[tree].right = _extents[r].link[tree].left;
+    _extents[r].link[tree].left = n;
+    updateExtent(n, tree);
+    updateExtent(r, tree);
+    return r;
+}
+
+/**
+ * Restore the AVL property of a node whose subtrees differ by at most 2 in height.
+ * 
+ * @return The new root of the subtree.
+ */
+uint32_t balanceExtent(uint32_t n, uint32_t tree) {
+    extent_links_t *l = &_extents[n].link[tree];
+    updateExtent(n, tree);
+
+    if (heightOf(l->left, tree) > heightOf(l->right, tree) + 1) {
+        extent_links_t *ll = &_extents[l->left].link[tree];
+        if (heightOf(ll->right, tree) > heightOf(ll->left, tree))
+            l->left = rotateLeft(l->left, tree);
+        return rotateRight(n, tree);
+    }
+    if (heightOf(l->right, tree) > heightOf(l->left, tree) + 1) {
+        extent_links_t *rl = &_extents[l->right].link[tree];
+        if (heightOf(rl->left, tree) > heightOf(rl->right, tree))
+            l->right = rotateRight(l->right, tree);
+        return rotateLeft(n, tree);
+    }
+    return n;
+}
+
+/**
+ * Insert a node in a subtree.
+ * The recursion is as deep as the tree, so O(log n).
+ * 
+ * @return The new root of the subtree.
+ */
+uint32_t insertExtent(uint32_t root, uint32_t n, uint32_t tree) {
+    if (root == NIL)
+        return n;
+
+    extent_links_t *l = &_extents[root].link[tree];
+    if (lessExtent(n, root, tree))
+        l->left = insertExtent(l->left, n, tree);
+    else
+        l->right = insertExtent(l->right, n, tree);
+
+    return balanceExtent(root, tree);
+}
+
+/**
+ * Unlink the node with the lowest key of a subtree.
+ * 
+ * @param min Where to put the unlinked node.
+ * @return The new root of the subtree.
+ */
+uint32_t unlinkMinExtent(uint32_t root, uint32_t *min, uint32_t tree) {
+    extent_links_t *l = &_extents[root].link[tree];
+
+    if (l->left == NIL) {
+        *min = root;
+        return l->right;
+    }
+
+    l->left = unlinkMinExtent(l->left, min, tree);
+    return balanceExtent(root, tree);
+}
+
+/**
+ * Unlink a node from a subtree.
+ * 
+ * @return The new root of the subtree.
+ */
+uint32_t unlinkExtent(uint32_t root, uint32_t n, uint32_t tree) {
+    if (root == NIL)
+        return NIL;
+
+    extent_links_t *l = &_extents[root].link[tree];
+    if (root == n) {
+        if (l->right == NIL)
+            return l->left;
+
+        // The successor takes its place
+        uint32_t min;
+        uint32_t right = unlinkMinExtent(l->right, &min, tree);
+        _extents[min].link[tree].left = l->left;
+        _extents[min].link[tree].right = right;
+        return balanceExtent(min, tree);
+    }
+
+    if (lessExtent(n, root, tree))
+        l->left = unlinkExtent(l->left, n, tree);
+    else
+        l->right = unlinkExtent(l->right, n, tree);
+    return balanceExtent(root, tree);
+}
+
+/**
+ * Add a new run to both trees of a zone.
+ */
+void addExtent(uint32_t frame, uint32_t count, uint32_t zone) {
+    uint32_t *root = _extentRoot[zone];
+    uint32_t n = newExtent(frame, count);
+
+    root[BY_ADDR] = insertExtent(root[BY_ADDR], n, BY_ADDR);
+    root[BY_SIZE] = insertExtent(root[BY_SIZE], n, BY_SIZE);
+}
+
+/**
+ * Remove a run from both trees of a zone and give its node back to the pool.
+ */
+void removeExtent(uint32_t n, uint32_t zone) {
+    uint32_t *root = _extentRoot[zone];
+
+    root[BY_ADDR] = unlinkExtent(root[BY_ADDR], n, BY_ADDR);
+    root[BY_SIZE] = unlinkExtent(root[BY_SIZE], n, BY_SIZE);
+    deleteExtentNode(n);
+}
+
+/**
+ * Find the runs right before and right after a frame.
+ * 
+ * @param frame The frame.
+ * @param prev Run with the highest address below frame (or NIL).
+ * @param next Run with the lowest address above frame (or NIL).
+ * @param zone Zone of the frame.
+ */
+void neighboursExtent(uint32_t frame, uint32_t *prev, uint32_t *next, uint32_t zone) {
+    uint32_t n = _extentRoot[zone][BY_ADDR];
+
+    *prev = NIL;
+    *next = NIL;
+    while (n != NIL) {
+        if (_extents[n].frame < frame) {
+            *prev = n;
+            n = _extents[n].link[BY_ADDR].right;
+        } else {
+            *next = n;
+            n = _extents[n].link[BY_ADDR].left;
+        }
+    }
+}
+
+/**
+ * Find the smallest run that has at least count frames (the lowest address among the same size).
+ * Taking the tightest run keeps the big ones for the big requests.
+ * 
+ * @return The node or NIL.
+ */
+uint32_t bestFitExtent(uint32_t count, uint32_t zone) {
+    uint32_t n = _extentRoot[zone][BY_SIZE];
+    uint32_t best = NIL;
+
+    while (n != NIL) {
+        if (_extents[n].count >= count) {
+            best = n;
+            n = _extents[n].link[BY_SIZE].left;
+        } else
+            n = _extents[n].link[BY_SIZE].right;
+    }
+    return best;
+}
+
+/**
+ * Backend Function.
+ * 
+ * @param nFrames Number of frames to keep track of.
+ * @return Bytes needed for the pool of nodes.
+ */
+uint32_t metadataSizePMM(uint32_t nFrames) {
+    // Node 0 isn't used
+    return (nFrames / 2 + 2 + PMM_ZONES) * sizeof(extent_t);
+}
+
+/**
+ * Backend Function.
+ * 
+ * Every frame starts as used, the free ones are added with freeFramesPMM().
+ * 
+ * @param metadata Where to put the pool of nodes (metadataSizePMM() bytes).
+ * @param nFrames Number of frames to keep track of.
+ */
+void initFramesPMM(void *metadata, uint32_t nFrames) {
+    uint32_t nodes = nFrames / 2 + 2 + PMM_ZONES;
+    uint32_t i;
+
+    _extents = metadata;
+    for (i = 0; i < PMM_ZONES; i++) {
+        _extentRoot[i][BY_ADDR] = NIL;
+        _extentRoot[i][BY_SIZE] = NIL;
+    }
+
+    // Every node is in the pool
+    for (i = 1; i < nodes; i++)
+        _extents[i].link[BY_ADDR].right = (i + 1 < nodes) ? i + 1 : NIL;
+    _extentPool = 1;
+}
+
+/**
+ * Backend Function.
+ * 
+ * Takes the best run that fits and puts back what is left of it.
+ * 
+ * @param count Number of contiguous frames.
+ * @param zone Zone to take them from.
+ * @return The first frame or PMM_NO_FRAME.
+ */
+uint32_t allocFramesPMM(uint32_t count, uint32_t zone) {
+    uint32_t n = bestFitExtent(count, zone);
+    if (n == NIL)
+        return PMM_NO_FRAME;
+
+    uint32_t frame = _extents[n].frame;
+    uint32_t left = _extents[n].count - count;
+
+    removeExtent(n, zone);
+    if (left > 0)
+        addExtent(frame + count, left, zone);
+
+    return frame;
+}
+
+/**
+ * Backend Function.
+ * 
+ * The run is merged with the one before and the one after if they are adjacent.
+ * 
+ * @param frame First frame of the run.
+ * @param count Number of frames.
+ * @param zone Zone of the run.
+ */
+void freeFramesPMM(uint32_t frame, uint32_t count, uint32_t zone) {
+    uint32_t prev, next;
+    neighboursExtent(frame, &prev, &next, zone);
+
+    if (prev != NIL && _extents[prev].frame + _extents[prev].count == frame) {
+        frame = _extents[prev].frame;
+        count += _extents[prev].count;
+        removeExtent(prev, zone);
+    }
+    if (next != NIL && _extents[next].frame == frame + count) {
+        count += _extents[next].count;
+        removeExtent(next, zone);
+    }
+
+    addExtent(frame, count, zone);
+}
@@ -0,0 +1,205 @@
+#include <mm/slab.h>
+#include <mm/vmm.h>
+
+#include <interrupts/interrupt.h>
+
+#include <debug_utils/printf.h>
+
+/**
+ * \brief Slab allocator: caches of objects of a fixed size.
+ * 
+ * Every cache carves its objects from whole pages (slabs), each with a small header at its start, 
+ * so the slab of an object is just its address rounded down to the page. 
+ * The free objects of a slab are a list through their own first word: no header before each object, 
+ * and both an allocation and a free are O(1) (a few pointers), whatever the number of objects.
+ * 
+ * Meant for small objects allocated and freed all the time (tasks, IRQ records, descriptors...): 
+ * same-sized objects packed in the same pages are denser than kmalloc() blocks and kinder to the cache.
+ */
+
+kmem_cache_t _slabCaches[SLAB_CACHES];
+
+/**
+ * Unlink a slab from one of the lists of its cache.
+ */
+void unlinkSlab(slab_t **list, slab_t *slab) {
+    if (slab->prev)
+        slab->prev->next = slab->next;
+    else
+        *list = slab->next;
+    if (slab->next)
+        slab->next->prev = slab->prev;
+}
+
+/**
+ * Put a slab at the head of one of the lists of its cache.
+ */
+void pushSlab(slab_t **list, slab_t *slab) {
+    slab->prev = NULL;
+    slab->next = *list;
+    if (*list)
+        (*list)->prev = slab;
+    *list = slab;
+}
+
+/**
+ * Get a new page from the VMM and make it a slab: all of its objects go in the free list.
+ * 
+ * @return The slab or null if there is no memory.
+ */
+slab_t *newSlab(kmem_cache_t *cache) {
+    slab_t *slab = vAllocPages(NULL, BIT_PD_PT_PRESENT | BIT_PD_PT_RW, 1, false);
+    if (!slab)
+        return NULL;
+
+    slab->cache = cache;
+    slab->inUse = 0;
+    slab->free = NULL;
+
+    // Linked from the last one, so they are handed out in address order
+    uint32_t i;
+    for (i = cache->perSlab; i > 0; i--) {
+        void **obj = (void **)((uint32_t)slab + cache->offset + (i - 1) * cache->size);
+        *obj = slab->free;
+        slab->free = obj;
+    }
+
+    cache->slabs++;
+    return slab;
+}
+
+/**
+ * Give a slab back to the VMM.
+ */
+void deleteSlab(kmem_cache_t *cache, slab_t *slab) {
+    cache->slabs--;
+    vFreePages(slab, 1);
+}
+
+/**
+ * Create a cache of objects.
+ * 
+ * @param name What the objects are (it isn't copied).
+ * @param size Bytes of an object (up to SLAB_MAX_OBJECT).
+ * @param align Alignment of the objects (a power of 2, 0 for the default).
+ * 
+ * @return The cache or null if the size is too big (or there is no free cache).
+ */
+kmem_cache_t *kmem_cache_create(const char *name, uint32_t size, uint32_t align) {
+    if (align < SLAB_MIN_ALIGN)
+        align = SLAB_MIN_ALIGN;
+    size = (size + align - 1) & ~(align - 1);
+    if (size == 0 || size > SLAB_MAX_OBJECT || !name)
+        return NULL;
+
+    uint32_t eflags = interrupt_save_disable();
+    kmem_cache_t *cache = NULL;
+    uint32_t i;
+    for (i = 0; i < SLAB_CACHES && !cache; i++)
+        if (!_slabCaches[i].name)
+            cache = &_slabCaches[i];
+
+    if (cache) {
+        cache->name = name;
+        cache->size = size;
+        cache->offset = (sizeof(slab_t) + align - 1) & ~(align - 1);
+        cache->perSlab = (PAGE_SIZE - cache->offset) / size;
+        cache->partial = cache->full = cache->empty = NULL;
+        cache->slabs = 0;
+        cache->objects = 0;
+    }
+    interrupt_restore(eflags);
+    return cache;
+}
+
+/**
+ * Destroy a cache and give its slabs back.
+ * 
+ * @return If it was destroyed (it can't be while some of its objects are allocated).
+ */
+bool kmem_cache_destroy(kmem_cache_t *cache) {
+    uint32_t eflags = interrupt_save_disable();
+    if (!cache->name || cache->objects > 0) {
+        interrupt_restore(eflags);
+        return false;
+    }
+
+    if (cache->empty)
+        deleteSlab(cache, cache->empty);
+    cache->name = NULL;
+    interrupt_restore(eflags);
+    return true;
+}
+
+/**
+ * Allocate an object, in O(1): from a partially used slab, or the empty one, or a new one.
+ * The memory isn't cleared (only a new slab starts as zeroes, except the first word of each object).
+ * 
+ * @param cache The cache.
+ * 
+ * @return The object or null if there is no memory.
+ */
+void *kmem_cache_alloc(kmem_cache_t *cache) {
+    uint32_t eflags = interrupt_save_disable();
+    slab_t *slab = cache->partial;
+
+    if (!slab) {
+        slab = cache->empty ? cache->empty : newSlab(cache);
+        if (!slab) {
+            interrupt_restore(eflags);
+            return NULL;
+        }
+        cache->empty = NULL;
+        pushSlab(&cache->partial, slab);
+    }
+
+    void **obj = slab->free;
+    slab->free = *obj;
+    slab->inUse++;
+    cache->objects++;
+
+    if (!slab->free) {
+        unlinkSlab(&cache->partial, slab);
+        pushSlab(&cache->full, slab);
+    }
+    interrupt_restore(eflags);
+    return obj;
+}
+
+/**
+ * Free an object, in O(1): its slab is the page it's in.
+ * A slab left empty is kept if the cache has no other empty slab, otherwise it goes back to the VMM.
+ * 
+ * @param cache The cache it was allocated from.
+ * @param obj The object.
+ */
+void kmem_cache_free(kmem_cache_t *cache, void *obj) {
+    slab_t *slab = (slab_t *)((uint32_t)obj & ~(PAGE_SIZE - 1));
+    uint32_t offset = (uint32_t)obj - (uint32_t)slab;
+
+    if (!obj || slab->cache != cache || offset < cache->offset || (offset - cache->offset) % cache->size != 0 || slab->inUse == 0) {
+        printf("SLAB: 0x%x isn't an allocated object of %s\n", obj, cache->name);
+        return;
+    }
+
+    uint32_t eflags = interrupt_save_disable();
+    bool wasFull = slab->free == NULL;
+
+    *(void **)obj = slab->free;
+    slab->free = obj;
+    slab->inUse--;
+    cache->objects--;
+
+    if (wasFull) {
+        unlinkSlab(&cache->full, slab);
+        pushSlab(&cache->partial, slab);
+    }
+    if (slab->inUse == 0) {
+        unlinkSlab(&cache->partial, slab);
+        if (cache->empty)
+            deleteSlab(cache, slab);
+        else
+            cache->empty = slab;
+    }
+    interrupt_restore(eflags);
+}
@@ -1,5 +1,6 @@
 #include <mm/vmm.h>
 #include <mm/pmm.h>
+#include <mm/vregion.h>
 
 #include <common/utility.h>
 
@@ -25,8 +26,423 @@
  *  1  1  1 - User process tried to write a page and caused a protection fault
  */
 
+vregion_t _kernelSpace;     ///< Free virtual addresses of the kernel
+uint32_t _bootLargePages = 1;  ///< 4MB pages mapped at KERNEL_VIRTUAL_BASE at boot: the kernel's, plus the ones of vMapBoot()
+uint32_t _kernelPageTables[1024 - 768];     ///< Page table of each kernel page directory entry, kept while a 4MB page is there (0 for the boot 4MB pages)
+
+address_space_t _addressSpaces[VMM_ADDRESS_SPACES];
+address_space_t *_kernelAddressSpace;       ///< The one built by init_vmm()
+address_space_t *_currentAddressSpace;      ///< The one in CR3
+
+/**
+ * A range of kernel virtual addresses the VMM knows something about: 
+ * its pages get a frame only when they are touched (vReserveLazy()), it has guard pages (vAllocGuarded()), 
+ * or it just has a name, for the fault reports (vNameRegion()).
+ */
+typedef struct vmm_region {
+	uint32_t start;     ///< First address
+	uint32_t pages;     ///< Number of pages, guard pages included (0 if the descriptor is free)
+	uint32_t flags;     ///< Flags of the pages mapped on a fault
+	bool lazy;          ///< If its pages get a frame on the first touch
+	uint8_t guards;     ///< VMM_GUARD_BELOW and/or VMM_GUARD_ABOVE: its first/last page is never mapped
+	const char *name;   ///< What it is
+} vmm_region_t;
+
+vmm_region_t _regions[VMM_REGIONS];
+
+/**
+ * Virtual address of the page table of a page directory entry (through the recursive mapping).
+ */
+uint32_t *ptOf(uint32_t pdIndex) {
+	return (uint32_t *)(PT_BASE_VADDR + pdIndex * 0x1000);
+}
+
+/**
+ * If the mappings of an address are global: the kernel half is the same in every address space, 
+ * but not the recursive mapping (each page directory maps itself there).
+ */
+bool isGlobal(uint32_t virt) {
+	return virt >= KERNEL_VIRTUAL_BASE && virt < PT_BASE_VADDR;
+}
+
+/**
+ * Remove the translations of a range from the TLB: 
+ * invlpg page by page for small ranges (it removes global entries too), 
+ * for big ones a CR3 reload or, if the range has global pages, a flush of everything.
+ * 
+ * @param virt Start address.
+ * @param n Number of pages.
+ */
+void flushRange(uint32_t virt, uint32_t n) {
+	if (n > VMM_FLUSH_PAGES) {
+		if (isGlobal(virt) || isGlobal(virt + (n - 1) * PAGE_SIZE))
+			paging_flush_global();
+		else
+			set_cr3(paging_get_cr3());
+		return;
+	}
+
+	uint32_t i;
+	for (i = 0; i < n; i++)
+		paging_invalidate_pte(virt + i * PAGE_SIZE);
+}
+
+bool unmapRange(uint32_t virt, uint32_t n, bool drop);
+void setKernelPde(uint32_t index, uint32_t pde);
+
+/**
+ * The page table of a page directory entry of the kernel half: 
+ * the one init_vmm() created (kept aside while a 4MB page is there), or a new one for the 4MB pages of the boot.
+ * 
+ * @return Its physical address or 0 if there is no memory.
+ */
+uint32_t kernelPageTable(uint32_t index) {
+	uint32_t *table = &_kernelPageTables[index - PAGE_DIRECTORY_INDEX(KERNEL_VIRTUAL_BASE)];
+
+	if (!*table) {
+		*table = pAllocPageFlags(PMM_ZONE_ANY | PMM_ZERO);
+		if (*table)
+			pGetPage(*table)->owner = PAGE_OWNER_PAGE_TABLE;
+	}
+	return *table;
+}
+
 /**
- * Allocate a virtual page and sets it to zero.
+ * Turn a 4MB page into a page table with the same 1024 mappings, so a part of it can be unmapped.
+ * 
+ * @param index Page directory entry of the 4MB page.
+ * 
+ * @return If there was memory for the page table.
+ */
+bool splitLargePage(uint32_t index) {
+	uint32_t *pd = PD_VADDR;
+	uint32_t *pt = ptOf(index);
+	uint32_t pde = pd[index];
+
+	bool kernel = index >= PAGE_DIRECTORY_INDEX(KERNEL_VIRTUAL_BASE);
+	uint32_t new_pt = kernel ? kernelPageTable(index) : pAllocPage();
+	if (!new_pt)
+		return false;
+	pGetPage(new_pt)->owner = PAGE_OWNER_PAGE_TABLE;
+
+	// Through the recursive mapping, pt was the first 4KB of the 4MB page: forget that translation
+	if (kernel)
+		setKernelPde(index, new_pt | BIT_PD_PT_RW | BIT_PD_PT_PRESENT);
+	else
+		pd[index] = new_pt | (pde & BIT_PD_PT_USER) | BIT_PD_PT_RW | BIT_PD_PT_PRESENT;
+	paging_invalidate_pte(pt);
+
+	uint32_t i, flags = pde & 0xFFF & ~BIT_PD_PAGE_SIZE;
+	for (i = 0; i < 1024; i++)
+		pt[i] = ((pde & 0xFFC00000) + i * PAGE_SIZE) | flags;
+	pGetPage(new_pt)->mapped = 1024;
+
+	// The whole 4MB translation goes away with a single invlpg
+	paging_invalidate_pte(index << PAGE_DIRECTORY_ADDR_OFFSET);
+	return true;
+}
+
+/**
+ * Walk the page tables of a range, a table at a time, and fill its PTEs.
+ * 
+ * First every table is checked (nothing in the range can be mapped already, nor be inside a 4MB page), 
+ * so a conflict doesn't leave anything half done. Missing tables are created and zeroed.
+ * 
+ * The kernel half is mapped global (see isGlobal()).
+ * 
+ * When a whole 4MB of the range has no page table yet (or an empty one, in the kernel half) 
+ * and both its virtual and physical addresses are 4MB aligned, it becomes a single 4MB page (PSE): one TLB entry instead of 1024. 
+ * In the kernel half the page directory entry changes in every address space (see setKernelPde()), 
+ * and the page table stays aside for when the 4MB page goes (see unmapRange()).
+ * 
+ * No TLB flush is needed: the CPU never caches the translation of a page that isn't present.
+ * 
+ * @param phys Physical address of the first page (contiguous), ignored if alloc is true.
+ * @param virt Start address.
+ * @param n Number of pages.
+ * @param flags Flags of the PTEs.
+ * @param alloc If every page gets a new zeroed frame instead.
+ * 
+ * @return If everything was mapped (if not, nothing is).
+ */
+bool mapRange(uint32_t phys, uint32_t virt, uint32_t n, uint32_t flags, bool alloc) {
+	uint32_t *pd = PD_VADDR;
+	uint32_t end = virt + n * PAGE_SIZE;
+	uint32_t vaddr, next;
+
+	if ((virt & 0xFFF) || n == 0 || end < virt)
+		return false;
+	if (isGlobal(virt))
+		flags |= BIT_PD_PT_GLOBAL;
+
+	for (vaddr = virt; vaddr < end; vaddr = next) {
+		uint32_t pde = pd[PAGE_DIRECTORY_INDEX(vaddr)];
+		next = (vaddr & 0xFFC00000) + 0x400000;
+		if (next > end || next == 0)
+			next = end;
+
+		if (!(pde & BIT_PD_PT_PRESENT))
+			continue;
+		if (pde & BIT_PD_PAGE_SIZE)
+			return false;
+
+		uint32_t *pt = ptOf(PAGE_DIRECTORY_INDEX(vaddr));
+		uint32_t i;
+		for (i = PAGE_TABLE_INDEX(vaddr); i <= PAGE_TABLE_INDEX(next - 1); i++)
+			if (pt[i] & BIT_PD_PT_PRESENT)
+				return false;
+	}
+
+	for (vaddr = virt; vaddr < end; vaddr = next) {
+		uint32_t index = PAGE_DIRECTORY_INDEX(vaddr);
+		next = (vaddr & 0xFFC00000) + 0x400000;
+		if (next > end || next == 0)
+			next = end;
+
+		uint32_t *pt = ptOf(index);
+		uint32_t chunkPhys = phys + (vaddr - virt);
+		if (!alloc && !(vaddr & 0x3FFFFF) && next - vaddr == LARGE_PAGE_SIZE && !(chunkPhys & 0x3FFFFF)) {
+			uint32_t large = chunkPhys | flags | BIT_PD_PAGE_SIZE | BIT_PD_PT_PRESENT;
+			if (!(pd[index] & BIT_PD_PT_PRESENT)) {
+				pd[index] = large;
+				continue;
+			}
+
+			page_t *table = pGetPage(pd[index] & 0xFFFFF000);
+			if (vaddr >= KERNEL_VIRTUAL_BASE && table && table->mapped == 0) {
+				// Through the recursive mapping, pt becomes the first 4KB of the 4MB page
+				setKernelPde(index, large);
+				paging_invalidate_pte(pt);
+				continue;
+			}
+		}
+
+		if (!(pd[index] & BIT_PD_PT_PRESENT)) {
+			// The page table doesn't exists
+			// Create a new one and map it into the page directory
+			uint32_t new_pt = pAllocPage();
+			if (!new_pt) {
+				unmapRange(virt, (vaddr - virt) / PAGE_SIZE, alloc);
+				return false;
+			}
+			pGetPage(new_pt)->owner = PAGE_OWNER_PAGE_TABLE;
+			pd[index] = new_pt | (flags & BIT_PD_PT_USER) | BIT_PD_PT_RW | BIT_PD_PT_PRESENT;
+			memset(pt, 0, PAGE_SIZE);
+		}
+
+		// Then the PTEs, in a tight loop
+		page_t *table = pGetPage(pd[index] & 0xFFFFF000);
+		uint32_t i, last = PAGE_TABLE_INDEX(next - 1);
+		for (i = PAGE_TABLE_INDEX(vaddr); i <= last; i++) {
+			uint32_t frame = phys + (vaddr - virt) + (i - PAGE_TABLE_INDEX(vaddr)) * PAGE_SIZE;
+			if (alloc) {
+				frame = pAllocPageFlags(PMM_ZONE_ANY | PMM_ZERO);
+				if (!frame) {
+					// Undo everything mapped so far (the frames are dropped with it), 
+					// this page included: it isn't mapped, but this way its page table is freed if it's empty
+					unmapRange(virt, ((vaddr & 0xFFC00000) + i * PAGE_SIZE - virt) / PAGE_SIZE + 1, true);
+					return false;
+				}
+				if (flags & BIT_PD_PT_USER)
+					pGetPage(frame)->owner = PAGE_OWNER_USER;
+			}
+			pt[i] = (frame & 0xFFFFF000) | flags | BIT_PD_PT_PRESENT;
+			table->mapped++;
+		}
+	}
+	return true;
+}
+
+/**
+ * Allocate n frames and map them from virt on, undoing everything if a page can't be mapped.
+ * 
+ * @return If every page was mapped.
+ */
+bool mapNewPages(uint32_t virt, uint32_t flags, uint32_t n) {
+	return mapRange(0, virt, n, flags, true);
+}
+
+/**
+ * Mapping n contiguous physical pages to contiguous virtual ones.
+ * Each page table is walked once, whatever the number of pages in it.
+ * 
+ * @see vUnmapRange()
+ * 
+ * @param phys Physical address of the first page.
+ * @param virt Virtual address to map phys to.
+ * @param n Number of pages.
+ * @param flags Flags.
+ * 
+ * @return If everything went well (if not, nothing was mapped).
+ */
+bool vMapRange(void *phys, void *virt, uint32_t n, uint32_t flags) {
+	return mapRange(phys, virt, n, flags, false);
+}
+
+/**
+ * Mapping a virtual address to a physical one.
+ * 
+ * @see vMapRange()
+ * 
+ * @param phys Physical address to map.
+ * @param virt Virtual address to map phys to.
+ * @param flags Flags.
+ * 
+ * @return If everything went well.
+ */
+bool vMapPage(void *phys, void *virt, uint32_t flags) {
+	return mapRange(phys, virt, 1, flags, false);
+}
+
+/**
+ * Free the page tables unmapRange() emptied, once nothing can reach them anymore: 
+ * their page directory entries are already cleared, but the CPU may still have them cached until the range is flushed. 
+ * Then their translations in the recursive mapping go too (a CR3 reload already took them).
+ */
+void freeTables(uint32_t start, uint32_t n, uint32_t *tables, uint32_t *indexes, uint32_t count) {
+	uint32_t i;
+
+	flushRange(start, n);
+	for (i = 0; i < count; i++) {
+		if (n <= VMM_FLUSH_PAGES)
+			paging_invalidate_pte(ptOf(indexes[i]));
+		pFreePage(tables[i]);
+	}
+}
+
+/**
+ * Unmap n pages, a page table at a time, then flush them from the TLB all at once.
+ * 
+ * Every page table knows how many of its entries are present (the 'mapped' field of its page_t), 
+ * so one left empty is found without looking at its 1024 entries: its page directory entry is cleared right away, 
+ * and it's freed after the flush (see freeTables()). Page tables of the kernel half are never freed, every address space shares them.
+ * 
+ * A 4MB page is removed whole if the range covers it, otherwise it's split in 4KB pages first. 
+ * In the kernel half its page table (empty) takes its place again.
+ * 
+ * @param virt Start address.
+ * @param n Number of pages.
+ * @param drop If the references of the mappings to their frames are dropped.
+ * 
+ * @return If something was unmapped.
+ */
+bool unmapRange(uint32_t virt, uint32_t n, bool drop) {
+	uint32_t *pd = PD_VADDR;
+	uint32_t start = virt;
+	uint32_t end = start + n * PAGE_SIZE;
+	uint32_t vaddr, next;
+	uint32_t tables[VMM_FLUSH_PAGES], indexes[VMM_FLUSH_PAGES], nTables = 0;
+	bool unmapped = false;
+
+	if ((start & 0xFFF) || n == 0 || end < start)
+		return false;
+
+	for (vaddr = start; vaddr < end; vaddr = next) {
+		uint32_t index = PAGE_DIRECTORY_INDEX(vaddr);
+		next = (vaddr & 0xFFC00000) + 0x400000;
+		if (next > end || next == 0)
+			next = end;
+
+		if (!(pd[index] & BIT_PD_PT_PRESENT))
+			continue;
+
+		uint32_t *pt = ptOf(index);
+		if (pd[index] & BIT_PD_PAGE_SIZE) {
+			if (next - vaddr == LARGE_PAGE_SIZE) {
+				// All of it
+				uint32_t pde = pd[index];
+				if (vaddr < KERNEL_VIRTUAL_BASE)
+					pd[index] = 0;
+				else if (kernelPageTable(index))
+					setKernelPde(index, kernelPageTable(index) | BIT_PD_PT_RW | BIT_PD_PT_PRESENT);
+				else {
+					printf("VMM: no memory for the page table to unmap the 4MB page at 0x%x\n", vaddr);
+					continue;
+				}
+				paging_invalidate_pte(pt);
+				unmapped = true;
+
+				uint32_t i;
+				for (i = 0; drop && i < 1024; i++) {
+					page_t *page = pGetPage((pde & 0xFFC00000) + i * PAGE_SIZE);
+					if (page && (page->flags & PAGE_USED))
+						pFreePage((pde & 0xFFC00000) + i * PAGE_SIZE);
+				}
+				continue;
+			}
+
+			if (!splitLargePage(index)) {
+				printf("VMM: no memory to split the 4MB page at 0x%x\n", vaddr & 0xFFC00000);
+				continue;
+			}
+		}
+
+		page_t *table = pGetPage(pd[index] & 0xFFFFF000);
+		uint32_t i;
+		for (i = PAGE_TABLE_INDEX(vaddr); i <= PAGE_TABLE_INDEX(next - 1); i++) {
+			uint32_t pte = pt[i];
+			if (!(pte & BIT_PD_PT_PRESENT))
+				continue;
+
+			pt[i] = 0;
+			table->mapped--;
+			unmapped = true;
+
+			page_t *page = pGetPage(pte & 0xFFFFF000);
+			if (drop && page && (page->flags & PAGE_USED))
+				pFreePage(pte & 0xFFFFF000);
+		}
+
+		if (table->mapped == 0 && vaddr < KERNEL_VIRTUAL_BASE) {
+			// The page table is empty: nothing can get to it from now on, it's freed after the flush
+			if (nTables == VMM_FLUSH_PAGES) {
+				freeTables(start, n, tables, indexes, nTables);
+				nTables = 0;
+			}
+			tables[nTables] = pd[index] & 0xFFFFF000;
+			indexes[nTables++] = index;
+			pd[index] = 0;
+		}
+	}
+
+	if (nTables > 0)
+		freeTables(start, n, tables, indexes, nTables);
+	else if (unmapped)
+		flushRange(start, n);
+	return unmapped;
+}
+
+/**
+ * Unmapping n pages from the current page directory, a page table at a time, 
+ * then flushing them from the TLB all at once.
+ * 
+ * Each mapping owned a reference to its frame, so it is dropped: 
+ * the frame is freed if nobody else uses it (frames the PMM doesn't allocate, like the kernel's, are left alone).
+ * 
+ * @see vMapRange()
+ * 
+ * @param virt Start address.
+ * @param n Number of pages.
+ * 
+ * @return If something was unmapped.
+ */
+bool vUnmapRange(void *virt, uint32_t n) {
+	return unmapRange(virt, n, true);
+}
+
+/**
+ * Unmapping the virtual address from the current page directory.
+ * 
+ * @see vUnmapRange()
+ * 
+ * @param virt Virtual address to unmap.
+ */
+bool vUnmapPage(void *virt) {
+	return vUnmapRange(virt, 1);
+}
+
+/**
+ * Allocate a virtual page and sets it to zero (with a frame from the pre-zeroed pool, if there is one).
  * 
  * @see vMapPage()
  * @see vAllocPages()
@@ -37,151 +453,814 @@
  * @return returns the virtual mapped address
  */
 void *vAllocPage(void *virt, uint32_t flags, bool man) {
-	uint32_t paddr = pAllocPage();
-	if (vMapPage(paddr, virt, flags))
-		return virt;
-	else if (man) {
-		// If that address was needed, unmap the physical address and return a null pointer
-		pFreePage(paddr);
-		return (void *)0;
-	} else {
-		// Try to map from 1MB to the end of the memory
-		uint32_t vaddr;
-		for (vaddr = 0x100000; vaddr < (_RAMSize * 1024); vaddr += PAGE_SIZE) {
-			if (vMapPage(paddr, vaddr, flags))
-				return vaddr;
-		}
-	}
-	pFreePage(paddr);
-	return (void *)0;
+	return vAllocPages(virt, flags, 1, man);
 }
 
 /**
  * Allocate n virtual page and sets them to zero.
  * 
+ * If virt is taken and it isn't mandatory, the pages go wherever the allocator of the kernel's 
+ * virtual addresses finds room for them (found in O(log n), see vregion.c).
+ * 
  * @see vMapPage()
  * @see vAllocPage()
+ * @see vFreePages()
  * 
- * @param virt Start address to map
+ * @param virt Start address to map (null for anywhere)
  * @param n Number of contiguous pages to map
  * @param man If that address is mandatory or could be anyone else
  * 
  * @return returns the starting virtual mapped address
  */
 void *vAllocPages(void *virt, uint32_t flags, uint32_t n, bool man) {
-	uint32_t paddr[n];
-	uint32_t vaddr = (uint32_t)virt;
+	if (n == 0)
+		return (void *)0;
 
-	paddr[0] =  pAllocPage();
-	
-	if (vMapPage(paddr[0], vaddr, flags)) {
-		// Continue to map for the remaining n
-		int32_t i;
-		for (i = 1, vaddr += PAGE_SIZE; i < (int32_t)n; i++, vaddr += PAGE_SIZE) {
-			paddr[i] = pAllocPage();
-			if (!vMapPage(paddr[i], vaddr, flags)) {
-				// Unmap all the mapping
-				for (vaddr -= PAGE_SIZE; i >= 0; i--, vaddr -= PAGE_SIZE) {
-					if (i != 0)
-						vUnmapPage(vaddr);
-					pFreePage(paddr[i]);
-				}
-				return (void *)0;
-			}
+	if (virt && reserveVRegion(&_kernelSpace, virt, n)) {
+		if (mapNewPages(virt, flags, n))
+			return virt;
+		freeVRegion(&_kernelSpace, virt, n);
+	}
+	if (man)
+		return (void *)0;
+
+	// Anywhere is fine
+	uint32_t vaddr = allocVRegion(&_kernelSpace, n);
+	if (!vaddr)
+		return (void *)0;
+	if (!mapNewPages(vaddr, flags, n)) {
+		freeVRegion(&_kernelSpace, vaddr, n);
+		return (void *)0;
+	}
+	return vaddr;
+}
+
+/**
+ * Take a free region descriptor.
+ * 
+ * @return The descriptor or null if they are all used.
+ */
+vmm_region_t *newRegion(uint32_t start, uint32_t pages, const char *name) {
+	uint32_t i;
+
+	for (i = 0; i < VMM_REGIONS; i++) {
+		if (_regions[i].pages)
+			continue;
+		memset(&_regions[i], 0, sizeof(vmm_region_t));
+		_regions[i].start = start;
+		_regions[i].pages = pages;
+		_regions[i].name = name;
+		return &_regions[i];
+	}
+	return (void *)0;
+}
+
+/**
+ * Find the region an address is in.
+ * 
+ * @return The descriptor or null.
+ */
+vmm_region_t *regionOf(uint32_t vaddr) {
+	uint32_t i;
+
+	for (i = 0; i < VMM_REGIONS; i++)
+		if (_regions[i].pages && vaddr >= _regions[i].start && (vaddr - _regions[i].start) / PAGE_SIZE < _regions[i].pages)
+			return &_regions[i];
+	return (void *)0;
+}
+
+/**
+ * Free the descriptor of the region that starts at an address, if there is one.
+ */
+void forgetRegion(uint32_t start) {
+	uint32_t i;
+
+	for (i = 0; i < VMM_REGIONS; i++)
+		if (_regions[i].pages && _regions[i].start == start)
+			_regions[i].pages = 0;
+}
+
+/**
+ * Map n contiguous physical pages (a device's memory, a multiboot module...) wherever the kernel has room for them.
+ * 
+ * If they cover a whole 4MB of physical memory, the virtual address is at the same place inside its 4MB as the physical one, 
+ * so every whole 4MB is a 4MB page (see mapRange()).
+ * 
+ * @see vMapRange()
+ * @see vFreePages()
+ * 
+ * @param phys Physical address of the first page.
+ * @param n Number of pages.
+ * @param flags Flags.
+ * 
+ * @return The virtual address of the first page or null.
+ */
+void *vMapPhysical(void *phys, uint32_t n, uint32_t flags) {
+	uint32_t first = (uint32_t)phys / PAGE_SIZE;
+	uint32_t vaddr = 0;
+
+	if (((first + 1023) & ~1023) + 1024 <= first + n) {
+		// Up to 1023 pages more, to find the right place, then what isn't needed goes back
+		uint32_t room = allocVRegion(&_kernelSpace, n + 1023);
+		if (room) {
+			vaddr = room + ((((uint32_t)phys & 0x3FF000) - (room & 0x3FF000)) & 0x3FF000);
+			if (vaddr > room)
+				freeVRegion(&_kernelSpace, room, (vaddr - room) / PAGE_SIZE);
+			if (vaddr + n * PAGE_SIZE < room + (n + 1023) * PAGE_SIZE)
+				freeVRegion(&_kernelSpace, vaddr + n * PAGE_SIZE, (room + (n + 1023) * PAGE_SIZE - vaddr) / PAGE_SIZE - n);
 		}
-		return virt;
-	} else if (man) 
+	}
+	if (!vaddr)
+		vaddr = allocVRegion(&_kernelSpace, n);
+	if (!vaddr)
 		return (void *)0;
-	else {
-		// Find the frist free page and then starts mapping
-		uint32_t new_vaddr = vAllocPage(virt, flags, false);
-
-		int32_t i;
-		for (i = 1, new_vaddr += PAGE_SIZE; i < (int32_t)n; i++, new_vaddr += PAGE_SIZE) {
-			paddr[i] = pAllocPage();
-			if (!vMapPage(paddr[i], new_vaddr, flags)) {
-				// Unmap all the mapping
-				for (new_vaddr -= PAGE_SIZE; i >= 0; i--, new_vaddr -= PAGE_SIZE) {
-					if (i != 0)
-						vUnmapPage(new_vaddr);
-					pFreePage(paddr[i]);
-				}
-				return (void *)0;
-			}
+	if (!vMapRange((uint32_t)phys & 0xFFFFF000, vaddr, n, flags)) {
+		freeVRegion(&_kernelSpace, vaddr, n);
+		return (void *)0;
+	}
+	return vaddr;
+}
+
+/**
+ * Unmap n pages allocated with vAllocPages() (their frames are dropped) and give their virtual addresses back.
+ * 
+ * @param virt Start address
+ * @param n Number of pages
+ */
+void vFreePages(void *virt, uint32_t n) {
+	forgetRegion(virt);
+	vUnmapRange(virt, n);
+	freeVRegion(&_kernelSpace, virt, n);
+}
+
+/**
+ * Reserve n virtual pages without giving them any memory: 
+ * a frame is allocated, zeroed and mapped the first time each page is touched (see vHandleFault()), 
+ * so a big heap or buffer costs no physical memory until it's used.
+ * 
+ * The addresses are found like vAllocPages() does, and are given back with vFreePages().
+ * 
+ * @see vAllocPages()
+ * 
+ * @param virt Start address (null for anywhere)
+ * @param flags Flags of the pages, once they are mapped
+ * @param n Number of contiguous pages
+ * @param man If that address is mandatory or could be anyone else
+ * 
+ * @return The starting virtual address, or null if there was no room (or no free descriptor)
+ */
+void *vReserveLazy(void *virt, uint32_t flags, uint32_t n, bool man) {
+	vmm_region_t *region = newRegion(0, 0, "lazy region");
+	if (!region || n == 0)
+		return (void *)0;
+
+	uint32_t vaddr = 0;
+	if (virt && ((uint32_t)virt & 0xFFF) == 0 && reserveVRegion(&_kernelSpace, virt, n))
+		vaddr = virt;
+	else if (!man)
+		vaddr = allocVRegion(&_kernelSpace, n);
+	if (!vaddr)
+		return (void *)0;
+
+	region->start = vaddr;
+	region->pages = n;
+	region->flags = flags;
+	region->lazy = true;
+	return vaddr;
+}
+
+/**
+ * Give a name to a range, for the fault reports (see vReportFault()). 
+ * If a region already starts there (e.g. one from vReserveLazy()), it's renamed.
+ * 
+ * @param virt Start address.
+ * @param n Number of pages.
+ * @param name The name (it isn't copied).
+ * 
+ * @return If there was a free descriptor.
+ */
+bool vNameRegion(void *virt, uint32_t n, const char *name) {
+	uint32_t i;
+
+	for (i = 0; i < VMM_REGIONS; i++) {
+		if (_regions[i].pages && _regions[i].start == (uint32_t)virt) {
+			_regions[i].name = name;
+			return true;
 		}
-		return new_vaddr;
 	}
+	return newRegion(virt, n, name) != (void *)0;
+}
 
+/**
+ * Allocate n pages between two guard pages, which are never mapped: 
+ * running off either end is a page fault right away (reported with the name of the range), 
+ * instead of a silent corruption of whatever is next to it.
+ * 
+ * @see vFreeGuarded()
+ * @see vAllocStack()
+ * 
+ * @param flags Flags of the pages.
+ * @param n Number of pages (guard pages excluded).
+ * @param name What they are, for the fault reports (it isn't copied).
+ * 
+ * @return The first page (right above the lower guard page) or null.
+ */
+void *vAllocGuarded(uint32_t flags, uint32_t n, const char *name) {
+	vmm_region_t *region = newRegion(0, 0, name);
+	if (!region || n == 0)
+		return (void *)0;
+
+	uint32_t vaddr = allocVRegion(&_kernelSpace, n + 2);
+	if (!vaddr)
+		return (void *)0;
+	if (!mapNewPages(vaddr + PAGE_SIZE, flags, n)) {
+		freeVRegion(&_kernelSpace, vaddr, n + 2);
+		return (void *)0;
+	}
+
+	region->start = vaddr;
+	region->pages = n + 2;
+	region->flags = flags;
+	region->guards = VMM_GUARD_BELOW | VMM_GUARD_ABOVE;
+	return vaddr + PAGE_SIZE;
 }
 
 /**
- * Mapping a virtual address to a physical one.
+ * Free n pages allocated with vAllocGuarded(), guard pages included.
  * 
- * @param phys Physical address to map.
- * @param virt Virtual address to map phys to.
- * @param flags Flags.
+ * @param virt The address vAllocGuarded() returned.
+ * @param n Number of pages (guard pages excluded).
+ */
+void vFreeGuarded(void *virt, uint32_t n) {
+	forgetRegion((uint32_t)virt - PAGE_SIZE);
+	vUnmapRange(virt, n);
+	freeVRegion(&_kernelSpace, (uint32_t)virt - PAGE_SIZE, n + 2);
+}
+
+/**
+ * Allocate a kernel stack of n pages, with a guard page below it (see vAllocGuarded()): 
+ * a stack overflow faults as soon as it happens.
  * 
- * @return If everything went well.
+ * @param n Number of pages.
+ * 
+ * @return The top of the stack (where esp starts) or null.
  */
-bool vMapPage(void *phys, void *virt, uint32_t flags) {
-	// Verify that the address is page-aligned
-	if (((uint32_t)virt & 0xFFFFF000) != (uint32_t)virt)
+void *vAllocStack(uint32_t n) {
+	uint32_t bottom = vAllocGuarded(BIT_PD_PT_PRESENT | BIT_PD_PT_RW, n, "kernel stack");
+	return bottom ? (void *)(bottom + n * PAGE_SIZE) : (void *)0;
+}
+
+/**
+ * Free a kernel stack allocated with vAllocStack().
+ * 
+ * @param top What vAllocStack() returned.
+ * @param n Number of pages.
+ */
+void vFreeStack(void *top, uint32_t n) {
+	vFreeGuarded((uint32_t)top - n * PAGE_SIZE, n);
+}
+
+/**
+ * Turn the first page of n already mapped pages into a guard page (e.g. for the boot stack, which is in the kernel image): 
+ * it's unmapped, without freeing its frame, and the range gets a name for the fault reports.
+ * 
+ * If the page is in a 4MB page of the kernel half (like the boot stack), that's split in a page table, in every address space.
+ * 
+ * @param virt The page to unmap.
+ * @param n Number of pages of the range, guard page included.
+ * @param name What it is (it isn't copied).
+ * 
+ * @return If it was done.
+ */
+bool vGuardBelow(void *virt, uint32_t n, const char *name) {
+	vmm_region_t *region = newRegion(virt, n, name);
+	if (!region)
 		return false;
 
-	uint32_t *pd = PD_VADDR;
-	if (!(pd[PAGE_DIRECTORY_INDEX((uint32_t)virt)] & 1)) {
-		// The page table doesn't exists
-		// Create a new one and map it into the page directory
-		uint32_t *new_pt = (uint32_t *)pAllocPage();
-		pd[PAGE_DIRECTORY_INDEX((uint32_t)virt)] = (uint32_t)new_pt | flags;
+	unmapRange(virt, 1, false);
+	region->guards = VMM_GUARD_BELOW;
+	return true;
+}
+
+/**
+ * Print what an address is: a region (and which of its guard pages), or another part of the virtual address space.
+ * 
+ * @param addr The address.
+ */
+void vDescribeAddress(void *addr) {
+	uint32_t vaddr = (uint32_t)addr;
+	vmm_region_t *region = regionOf(vaddr);
+
+	if (region) {
+		uint32_t page = (vaddr - region->start) / PAGE_SIZE;
+		if ((region->guards & VMM_GUARD_BELOW) && page == 0)
+			printf("0x%x is in the guard page below %s (0x%x - 0x%x): overflow\n", vaddr, region->name, region->start, region->start + region->pages * PAGE_SIZE);
+		else if ((region->guards & VMM_GUARD_ABOVE) && page == region->pages - 1)
+			printf("0x%x is in the guard page above %s (0x%x - 0x%x): overflow\n", vaddr, region->name, region->start, region->start + region->pages * PAGE_SIZE);
+		else
+			printf("0x%x is in %s (0x%x - 0x%x)%s\n", vaddr, region->name, region->start, region->start + region->pages * PAGE_SIZE, region->lazy ? ", mapped on first touch" : "");
+		return;
 	}
 
-	uint32_t *pt = (uint32_t *)(PT_BASE_VADDR + (PAGE_DIRECTORY_INDEX((uint32_t)virt) * 0x1000));
-	if (!(pt[PAGE_TABLE_INDEX((uint32_t)virt)] & 1)) {
-		// The page isn't present
-		pt[PAGE_TABLE_INDEX((uint32_t)virt)] = (uint32_t)phys | flags;
-		
-	} else
+	if (vaddr < 0x1000)
+		printf("0x%x is in the first page: null pointer\n", vaddr);
+	else if (vaddr < KERNEL_VIRTUAL_BASE)
+		printf("0x%x is in the user half\n", vaddr);
+	else if (vaddr < (uint32_t)&end)
+		printf("0x%x is in the kernel image\n", vaddr);
+	else if (vaddr >= _pmmMetadataStart && vaddr < _pmmMetadataStart + _pmmMetadataSize)
+		printf("0x%x is in the PMM metadata\n", vaddr);
+	else if (vaddr >= TEMP_WINDOWS_VADDR && vaddr < PT_BASE_VADDR)
+		printf("0x%x is in the temporary windows of the VMM\n", vaddr);
+	else if (vaddr >= PT_BASE_VADDR)
+		printf("0x%x is in the page tables (recursive mapping)\n", vaddr);
+	else
+		printf("0x%x isn't in any region\n", vaddr);
+}
+
+/**
+ * Print a page fault the VMM couldn't handle: its address, what the error code says (see the table at the top of this file) 
+ * and what the address is (see vDescribeAddress()).
+ * 
+ * @param addr The address that caused the fault (CR2).
+ * @param err The error code pushed by the CPU.
+ */
+void vReportFault(void *addr, uint32_t err) {
+	printf("Page fault at 0x%x: %s %s, %s\n", addr, 
+		(err & PF_USER) ? "user" : "supervisor", 
+		(err & PF_WRITE) ? "write" : "read", 
+		(err & PF_PRESENT) ? "protection violation" : "page not present");
+	vDescribeAddress(addr);
+}
+
+/**
+ * A write to a page shared by vCloneSpace(): the space gets a copy of its own. 
+ * If nobody else has the frame anymore (the other spaces already copied it, or are gone), 
+ * it's just made writable again, without copying.
+ * 
+ * @param vaddr Page that was written.
+ * @param err The error code of the fault.
+ * 
+ * @return If it was a copy-on-write page (and there was memory for the copy).
+ */
+bool copyOnWrite(uint32_t vaddr, uint32_t err) {
+	uint32_t *pd = PD_VADDR;
+	uint32_t index = PAGE_DIRECTORY_INDEX(vaddr);
+
+	if (!(pd[index] & BIT_PD_PT_PRESENT) || (pd[index] & BIT_PD_PAGE_SIZE))
 		return false;
 
-	printf("physical address 0x%x mapped at 0x%x with flags 0x%x\n", phys, virt, flags);
+	uint32_t *pte = &ptOf(index)[PAGE_TABLE_INDEX(vaddr)];
+	if (!(*pte & BIT_PD_PT_COW) || ((err & PF_USER) && !(*pte & BIT_PD_PT_USER)))
+		return false;
+
+	uint32_t frame = *pte & 0xFFFFF000;
+	uint32_t flags = (*pte & 0xFFF & ~BIT_PD_PT_COW) | BIT_PD_PT_RW;
+	page_t *page = pGetPage(frame);
+
+	if (page && page->refcount > 1) {
+		uint32_t copy = pAllocPage();
+		if (!copy) {
+			printf("VMM: no memory to copy the page at 0x%x\n", vaddr);
+			return false;
+		}
+		pGetPage(copy)->owner = page->owner;
+
+		// The page itself is still readable: copy it straight into the new frame
+		void *window = vMapTemp(copy);
+		if (!window) {
+			printf("VMM: can't map the copy of the page at 0x%x\n", vaddr);
+			pFreePage(copy);
+			return false;
+		}
+		memcpy(window, vaddr, PAGE_SIZE);
+		vUnmapTemp();
+		pFreePage(frame);
+		frame = copy;
+	}
+
+	*pte = frame | flags;
+	paging_invalidate_pte(vaddr);
 	return true;
 }
 
 /**
- * Unmapping the virtual address from the current page directory.
+ * Page fault handler of the VMM (vector 14).
  * 
- * @param virt Virtual address to unmap.
+ * A page that isn't present inside a range reserved with vReserveLazy() gets its frame now, 
+ * a write to a copy-on-write page gets its own copy (see copyOnWrite()), 
+ * and the faulting instruction runs again once the handler returns.
+ * Anything else (another protection fault, an address nobody reserved, a guard page, a user access to a kernel range) 
+ * is a real fault (see vReportFault()).
+ * 
+ * @param addr The address that caused the fault (CR2).
+ * @param err The error code pushed by the CPU (see the table at the top of this file).
+ * 
+ * @return If the fault was handled.
  */
-bool vUnmapPage(void *virt) {
-	// Verify that the address is page-aligned
-	if (((uint32_t)virt & 0xFFFFF000) != (uint32_t)virt)
+bool vHandleFault(void *addr, uint32_t err) {
+	uint32_t vaddr = (uint32_t)addr & 0xFFFFF000;
+
+	if (err & PF_PRESENT)
+		return (err & PF_WRITE) && copyOnWrite(vaddr, err);
+
+	// Guard pages are never lazy
+	vmm_region_t *region = regionOf(vaddr);
+	if (!region || !region->lazy)
 		return false;
 
+	if ((err & PF_USER) && !(region->flags & BIT_PD_PT_USER))
+		return false;
+	if (!mapNewPages(vaddr, region->flags, 1)) {
+		printf("VMM: no memory for the page at 0x%x\n", vaddr);
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Map a frame in one of the windows at the end of the kernel half (TEMP_WINDOWS_VADDR up to TEMP_MAP_VADDR).
+ * They all are in the page table of TEMP_MAP_VADDR, so they are the same in every address space.
+ * 
+ * @param window Virtual address of the window.
+ * @param phys Physical address of the frame.
+ * 
+ * @return window or a null pointer if there was no memory for the page table.
+ */
+void *mapWindow(uint32_t window, uint32_t phys) {
 	uint32_t *pd = PD_VADDR;
-	
-	if (pd[PAGE_DIRECTORY_INDEX((uint32_t)virt)] & 1) {
-		// The page table is present
-		uint32_t *pt = (uint32_t *)(PT_BASE_VADDR + (PAGE_DIRECTORY_INDEX((uint32_t)virt) * 0x1000));
-		if (pt[PAGE_TABLE_INDEX((uint32_t)virt)] & 1)
-			// The page is mapped, unmap it.
-			// Set not-present, but r/w
-			pt[PAGE_TABLE_INDEX((uint32_t)virt)] = 0x2;		
-		
-		// Check if there are no more pages present
-		int i = 0;
-		while (i < 1024 && !(pt[i] & 1)) {
-			i++;
+	uint32_t *pt = ptOf(PAGE_DIRECTORY_INDEX(window));
+
+	if (!(pd[PAGE_DIRECTORY_INDEX(window)] & 1)) {
+		// First time: the page table of the windows is created once and never freed
+		uint32_t new_pt = pAllocPage();
+		if (!new_pt)
+			return (void *)0;
+		pGetPage(new_pt)->owner = PAGE_OWNER_PAGE_TABLE;
+
+		pd[PAGE_DIRECTORY_INDEX(window)] = new_pt | BIT_PD_PT_RW | BIT_PD_PT_PRESENT;
+		paging_invalidate_pte(pt);
+		memset(pt, 0, PAGE_SIZE);
+	}
+
+	if (!(pt[PAGE_TABLE_INDEX(window)] & BIT_PD_PT_PRESENT))
+		pGetPage(pd[PAGE_DIRECTORY_INDEX(window)] & 0xFFFFF000)->mapped++;
+	pt[PAGE_TABLE_INDEX(window)] = (phys & 0xFFFFF000) | BIT_PD_PT_GLOBAL | BIT_PD_PT_RW | BIT_PD_PT_PRESENT;
+	paging_invalidate_pte(window);
+	return window;
+}
+
+/**
+ * Close a window opened by mapWindow().
+ */
+void unmapWindow(uint32_t window) {
+	uint32_t *pd = PD_VADDR;
+	uint32_t *pt = ptOf(PAGE_DIRECTORY_INDEX(window));
+
+	if (pt[PAGE_TABLE_INDEX(window)] & BIT_PD_PT_PRESENT)
+		pGetPage(pd[PAGE_DIRECTORY_INDEX(window)] & 0xFFFFF000)->mapped--;
+	pt[PAGE_TABLE_INDEX(window)] = 0;
+	paging_invalidate_pte(window);
+}
+
+/**
+ * Map a frame at TEMP_MAP_VADDR, to get to what's inside it (e.g. to zero it) without a real mapping.
+ * There is just one window: it must be used with interrupts disabled and given back with vUnmapTemp().
+ * 
+ * @param phys Physical address of the frame.
+ * 
+ * @return TEMP_MAP_VADDR or a null pointer if there was no memory for the page table.
+ */
+void *vMapTemp(void *phys) {
+	return mapWindow(TEMP_MAP_VADDR, phys);
+}
+
+/**
+ * Close the window opened by vMapTemp().
+ */
+void vUnmapTemp() {
+	unmapWindow(TEMP_MAP_VADDR);
+}
+
+/**
+ * The windows used by the address space functions, to get to the paging structures of a space that isn't the current one 
+ * (the recursive mapping only shows the current one). 
+ * They are used with interrupts disabled.
+ */
+#define WINDOW_SRC_PD (TEMP_WINDOWS_VADDR + 0 * PAGE_SIZE)
+#define WINDOW_SRC_PT (TEMP_WINDOWS_VADDR + 1 * PAGE_SIZE)
+#define WINDOW_DST_PD (TEMP_WINDOWS_VADDR + 2 * PAGE_SIZE)
+#define WINDOW_DST_PT (TEMP_WINDOWS_VADDR + 3 * PAGE_SIZE)
+
+/**
+ * Change a page directory entry of the kernel half in every address space: 
+ * their kernel halves are the same (see vCreateSpace()), so they must stay that way. 
+ * The TLB of the current one is up to the caller.
+ */
+void setKernelPde(uint32_t index, uint32_t pde) {
+	uint32_t eflags = interrupt_save_disable();
+	uint32_t *pd = PD_VADDR;
+	uint32_t i;
+
+	pd[index] = pde;
+	for (i = 0; i < VMM_ADDRESS_SPACES; i++) {
+		address_space_t *space = &_addressSpaces[i];
+		if (!space->pd || space == _currentAddressSpace)
+			continue;
+
+		uint32_t *other = mapWindow(WINDOW_DST_PD, space->pd);
+		if (!other) {
+			printf("VMM: can't update the kernel half of the address space at 0x%x\n", space->pd);
+			continue;
+		}
+		other[index] = pde;
+		unmapWindow(WINDOW_DST_PD);
+	}
+	interrupt_restore(eflags);
+}
+
+/**
+ * Allocate a page table (or directory) for another address space and zero it through a window.
+ * 
+ * @return Its physical address or 0.
+ */
+uint32_t newTable(uint32_t window) {
+	uint32_t table = pAllocPage();
+	if (!table)
+		return 0;
+	pGetPage(table)->owner = PAGE_OWNER_PAGE_TABLE;
+
+	memset(mapWindow(window, table), 0, PAGE_SIZE);
+	unmapWindow(window);
+	return table;
+}
+
+/**
+ * Create an empty address space: nothing in the user half, 
+ * and the kernel half shared by reference (its page directory entries point to the very same page tables, 
+ * which init_vmm() created once for all of them, so a kernel mapping made in any space is seen in every other one).
+ * 
+ * @see vDestroySpace()
+ * 
+ * @return The address space or null if there is no memory (or no free slot).
+ */
+address_space_t *vCreateSpace() {
+	address_space_t *space = (void *)0;
+	uint32_t i;
+
+	for (i = 0; i < VMM_ADDRESS_SPACES && !space; i++)
+		if (!_addressSpaces[i].pd)
+			space = &_addressSpaces[i];
+	if (!space)
+		return (void *)0;
+
+	uint32_t eflags = interrupt_save_disable();
+	uint32_t pd_p = newTable(WINDOW_DST_PD);
+	if (!pd_p) {
+		interrupt_restore(eflags);
+		return (void *)0;
+	}
+
+	uint32_t *pd = PD_VADDR;
+	uint32_t *new_pd = mapWindow(WINDOW_DST_PD, pd_p);
+	for (i = PAGE_DIRECTORY_INDEX(KERNEL_VIRTUAL_BASE); i < PAGE_DIRECTORY_INDEX(PD_VADDR); i++)
+		new_pd[i] = pd[i];
+	// Its own recursive mapping
+	new_pd[PAGE_DIRECTORY_INDEX(PD_VADDR)] = pd_p | BIT_PD_PT_RW | BIT_PD_PT_PRESENT;
+	unmapWindow(WINDOW_DST_PD);
+
+	space->pd = pd_p;
+	interrupt_restore(eflags);
+	return space;
+}
+
+/**
+ * Drop the references of the pages of the user half of an address space and free its page tables.
+ * 
+ * @param pd The page directory, through a window.
+ */
+void clearUserHalf(uint32_t *pd) {
+	uint32_t i, j;
+
+	for (i = 0; i < PAGE_DIRECTORY_INDEX(KERNEL_VIRTUAL_BASE); i++) {
+		uint32_t pde = pd[i];
+		if (!(pde & BIT_PD_PT_PRESENT))
+			continue;
+		pd[i] = 0;
+
+		if (pde & BIT_PD_PAGE_SIZE) {
+			for (j = 0; j < 1024; j++) {
+				page_t *page = pGetPage((pde & 0xFFC00000) + j * PAGE_SIZE);
+				if (page && (page->flags & PAGE_USED))
+					pFreePage((pde & 0xFFC00000) + j * PAGE_SIZE);
+			}
+			continue;
+		}
+
+		uint32_t *pt = mapWindow(WINDOW_SRC_PT, pde & 0xFFFFF000);
+		for (j = 0; j < 1024; j++) {
+			if (!(pt[j] & BIT_PD_PT_PRESENT))
+				continue;
+			page_t *page = pGetPage(pt[j] & 0xFFFFF000);
+			if (page && (page->flags & PAGE_USED))
+				pFreePage(pt[j] & 0xFFFFF000);
+		}
+		unmapWindow(WINDOW_SRC_PT);
+		pFreePage(pde & 0xFFFFF000);
+	}
+}
+
+/**
+ * Copy an address space, copy-on-write: the kernel half is shared as in vCreateSpace() (just 255 page directory entries), 
+ * and the user half gets new page tables pointing to the same frames. 
+ * The writable pages become read-only in both spaces (BIT_PD_PT_COW), each frame gets a reference for the new mapping, 
+ * and the first write to one of them copies just that page (see vHandleFault()). 
+ * So it costs the page tables, not the memory in them.
+ * 
+ * 4MB pages map physical ranges (devices, buffers), so they stay shared as they are.
+ * 
+ * @param src The address space to copy (it can be the current one).
+ * 
+ * @return The copy or null if there was no memory (nothing is left behind).
+ */
+address_space_t *vCloneSpace(address_space_t *src) {
+	address_space_t *space = vCreateSpace();
+	if (!space)
+		return (void *)0;
+
+	uint32_t eflags = interrupt_save_disable();
+	uint32_t *src_pd = mapWindow(WINDOW_SRC_PD, src->pd);
+	uint32_t *dst_pd = mapWindow(WINDOW_DST_PD, space->pd);
+	uint32_t i, j;
+
+	for (i = 0; i < PAGE_DIRECTORY_INDEX(KERNEL_VIRTUAL_BASE); i++) {
+		uint32_t pde = src_pd[i];
+		if (!(pde & BIT_PD_PT_PRESENT))
+			continue;
+
+		if (pde & BIT_PD_PAGE_SIZE) {
+			for (j = 0; j < 1024; j++)
+				pRefPage((pde & 0xFFC00000) + j * PAGE_SIZE);
+			dst_pd[i] = pde;
+			continue;
+		}
+
+		uint32_t pt_p = newTable(WINDOW_DST_PT);
+		if (!pt_p)
+			goto fail;
+		dst_pd[i] = pt_p | (pde & 0xFFF);
+
+		uint32_t *dst_pt = mapWindow(WINDOW_DST_PT, pt_p);
+		uint32_t *src_pt = mapWindow(WINDOW_SRC_PT, pde & 0xFFFFF000);
+		pGetPage(pt_p)->mapped = pGetPage(pde & 0xFFFFF000)->mapped;
+		for (j = 0; j < 1024; j++) {
+			uint32_t pte = src_pt[j];
+			if (!(pte & BIT_PD_PT_PRESENT))
+				continue;
+
+			// Frames the PMM doesn't allocate (like a device's) are just shared
+			if (pRefPage(pte & 0xFFFFF000) && (pte & BIT_PD_PT_RW)) {
+				pte = (pte & ~BIT_PD_PT_RW) | BIT_PD_PT_COW;
+				src_pt[j] = pte;
+			}
+			dst_pt[j] = pte;
 		}
+		unmapWindow(WINDOW_SRC_PT);
+		unmapWindow(WINDOW_DST_PT);
+	}
+
+	unmapWindow(WINDOW_SRC_PD);
+	unmapWindow(WINDOW_DST_PD);
+	// The source lost its write access: the user half isn't global, so a CR3 reload is enough
+	if (src == _currentAddressSpace)
+		set_cr3(paging_get_cr3());
+	interrupt_restore(eflags);
+	return space;
+
+fail:
+	// What was shared so far is dropped with the space (the source keeps its pages read-only until it writes them)
+	unmapWindow(WINDOW_SRC_PD);
+	unmapWindow(WINDOW_DST_PD);
+	if (src == _currentAddressSpace)
+		set_cr3(paging_get_cr3());
+	interrupt_restore(eflags);
+	vDestroySpace(space);
+	return (void *)0;
+}
+
+/**
+ * Destroy an address space: the pages of its user half are dropped, its page tables and directory freed.
+ * The kernel half is shared, so it's left alone.
+ * 
+ * @param space The address space (neither the current one nor the kernel's).
+ * 
+ * @return If it was destroyed.
+ */
+bool vDestroySpace(address_space_t *space) {
+	if (!space || !space->pd || space == _currentAddressSpace || space == _kernelAddressSpace)
+		return false;
+
+	uint32_t eflags = interrupt_save_disable();
+	clearUserHalf(mapWindow(WINDOW_DST_PD, space->pd));
+	unmapWindow(WINDOW_DST_PD);
+	pFreePage(space->pd);
+	space->pd = 0;
+	interrupt_restore(eflags);
+	return true;
+}
+
+/**
+ * Make an address space the current one.
+ * The kernel pages are global (see isGlobal()), so they stay in the TLB: only the user half is flushed.
+ * 
+ * @param space The address space.
+ */
+void vSwitchSpace(address_space_t *space) {
+	if (space == _currentAddressSpace)
+		return;
+
+	uint32_t eflags = interrupt_save_disable();
+	_currentAddressSpace = space;
+	set_cr3(space->pd);
+	interrupt_restore(eflags);
+}
+
+/**
+ * Before init_vmm(): map the higher half up to virt + size in the boot page directory, 
+ * with 4MB pages after the kernel's one (like it, KERNEL_VIRTUAL_BASE + x is the physical address x). 
+ * That's how the PMM gets to its metadata when it doesn't fit in the first 4MB (see placeMetadata()); 
+ * init_vmm() maps the same 4MB pages in the new page directory.
+ * 
+ * @param virt Start of the range (in the higher half).
+ * @param size Bytes.
+ * 
+ * @return If it's mapped (false if the range would get to the kernel's virtual addresses, VMM_KERNEL_SPACE_START).
+ */
+bool vMapBoot(void *virt, uint32_t size) {
+	uint32_t *pd = PD_VADDR;
+	uint32_t end = (uint32_t)virt + size;
+
+	if ((uint32_t)virt < KERNEL_VIRTUAL_BASE || end < (uint32_t)virt || end > VMM_KERNEL_SPACE_START)
+		return false;
+
+	uint32_t pages = (end - KERNEL_VIRTUAL_BASE + LARGE_PAGE_SIZE - 1) / LARGE_PAGE_SIZE;
+	for (; _bootLargePages < pages; _bootLargePages++)
+		pd[PAGE_DIRECTORY_INDEX(KERNEL_VIRTUAL_BASE) + _bootLargePages] = (_bootLargePages * LARGE_PAGE_SIZE) | 
+			BIT_PD_PAGE_SIZE | BIT_PD_PT_GLOBAL | BIT_PD_PT_RW | BIT_PD_PT_PRESENT;
+	return true;
+}
 
-		if (i == 1024)
-			// The page table is empty, free the memory
-			pFreePage(pd[PAGE_DIRECTORY_INDEX((uint32_t)virt)] & 0xFFFFF000);
-			
-		printf("virtual 0x%x unmapped\n", virt);
-		return true;
+/**
+ * Map a page in any address space, the current one or not. 
+ * In another one, its page directory and page tables are reached through windows: 
+ * no CR3 switch, and no TLB flush (the TLB has nothing of a space that isn't the current one).
+ * 
+ * @see vMapPage()
+ * 
+ * @param space The address space.
+ * @param phys Physical address to map.
+ * @param virt Virtual address to map phys to (in the kernel half, it is mapped in every space).
+ * @param flags Flags.
+ * 
+ * @return If everything went well.
+ */
+bool vMapPageIn(address_space_t *space, void *phys, void *virt, uint32_t flags) {
+	if (space == _currentAddressSpace || (uint32_t)virt >= KERNEL_VIRTUAL_BASE)
+		return vMapPage(phys, virt, flags);
+	if ((uint32_t)virt & 0xFFF)
+		return false;
+
+	uint32_t eflags = interrupt_save_disable();
+	uint32_t *pd = mapWindow(WINDOW_DST_PD, space->pd);
+	uint32_t index = PAGE_DIRECTORY_INDEX((uint32_t)virt);
+	bool ok = false;
+
+	if (!(pd[index] & BIT_PD_PT_PRESENT)) {
+		uint32_t new_pt = newTable(WINDOW_DST_PT);
+		if (new_pt)
+			pd[index] = new_pt | (flags & BIT_PD_PT_USER) | BIT_PD_PT_RW | BIT_PD_PT_PRESENT;
+	}
+
+	if ((pd[index] & BIT_PD_PT_PRESENT) && !(pd[index] & BIT_PD_PAGE_SIZE)) {
+		uint32_t *pt = mapWindow(WINDOW_DST_PT, pd[index] & 0xFFFFF000);
+		if (!(pt[PAGE_TABLE_INDEX((uint32_t)virt)] & BIT_PD_PT_PRESENT)) {
+			pt[PAGE_TABLE_INDEX((uint32_t)virt)] = ((uint32_t)phys & 0xFFFFF000) | flags | BIT_PD_PT_PRESENT;
+			pGetPage(pd[index] & 0xFFFFF000)->mapped++;
+			ok = true;
+		}
+		unmapWindow(WINDOW_DST_PT);
 	}
-	return false;
+
+	unmapWindow(WINDOW_DST_PD);
+	interrupt_restore(eflags);
+	return ok;
+}
+
+/**
+ * A page for more nodes of the allocator of the kernel's virtual addresses, when it has a lot of small free ranges (see growVRegion()).
+ */
+void *kernelSpacePage() {
+	return vAllocPages((void *)0, BIT_PD_PT_PRESENT | BIT_PD_PT_RW, 1, false);
 }
 
 /**
@@ -226,6 +1305,7 @@ void init_vmm() {
 	uint32_t *pd_p __attribute__((aligned(4096))) = pAllocPage();
 	uint32_t *pd_v = 0xAAAAAA000;
 	vMapPage(pd_p, pd_v, BIT_PD_PT_RW | BIT_PD_PT_PRESENT); 
+	memset(pd_v, 0, PAGE_SIZE);
 
     /**
      * Using the 'recursive mapping' technique.
@@ -243,16 +1323,42 @@ void init_vmm() {
 	self_pde_v = (uint32_t)pd_p | BIT_PD_PT_PRESENT | BIT_PD_PT_RW;
 	pd_v[PAGE_DIRECTORY_INDEX(PD_VADDR)] = self_pde_v;
 	
-	// 4MB page for the kernel
-	uint32_t *kernel_pde_v = 0xAB2AA000; 
-	uint32_t *kernel_pde_p __attribute__((aligned(4096))) = (uint32_t)pAllocPage();
-	vMapPage(kernel_pde_p, kernel_pde_v, BIT_PD_PT_RW | BIT_PD_PT_PRESENT);
-	memset(kernel_pde_v, 0, sizeof(kernel_pde_v));
-
-	kernel_pde_v = BIT_PD_PAGE_SIZE | BIT_PD_PT_PRESENT | BIT_PD_PT_RW;
-	pd_v[PAGE_DIRECTORY_INDEX(KERNEL_VIRTUAL_BASE)] = kernel_pde_v;
+	// 4MB pages for the kernel, and for the PMM metadata if it goes past the first 4MB (see vMapBoot())
+	uint32_t i;
+	for (i = 0; i < _bootLargePages; i++)
+		pd_v[PAGE_DIRECTORY_INDEX(KERNEL_VIRTUAL_BASE) + i] = (i * LARGE_PAGE_SIZE) | 
+			BIT_PD_PAGE_SIZE | BIT_PD_PT_GLOBAL | BIT_PD_PT_PRESENT | BIT_PD_PT_RW;
 
 	// Set the new Page Directory officially
 	set_cr3(pd_p);
+
+	/**
+	 * Every page table of the kernel half is created now, once, so every address space can share them 
+	 * (vCreateSpace() copies them, and nothing has to be synced when the kernel maps 4KB pages). 
+	 * The price: 255 page tables, about 1MB of frames, whatever the kernel ends up using.
+	 * 
+	 * Their page directory entries only change for 4MB pages (an empty table is swapped for one, see mapRange()), 
+	 * and then in every address space at once (see setKernelPde()).
+	 */
+	uint32_t *pd = PD_VADDR;
+	for (i = PAGE_DIRECTORY_INDEX(KERNEL_VIRTUAL_BASE); i < PAGE_DIRECTORY_INDEX(PD_VADDR); i++) {
+		if (pd[i] & BIT_PD_PT_PRESENT)
+			continue;
+		uint32_t new_pt = pAllocPage();
+		if (!new_pt) {
+			printf("VMM: no memory for the kernel page tables\n");
+			break;
+		}
+		pGetPage(new_pt)->owner = PAGE_OWNER_PAGE_TABLE;
+		pd[i] = new_pt | BIT_PD_PT_RW | BIT_PD_PT_PRESENT;
+		_kernelPageTables[i - PAGE_DIRECTORY_INDEX(KERNEL_VIRTUAL_BASE)] = new_pt;
+		memset(ptOf(i), 0, PAGE_SIZE);
+	}
+
+	_kernelAddressSpace = &_addressSpaces[0];
+	_kernelAddressSpace->pd = pd_p;
+	_currentAddressSpace = _kernelAddressSpace;
+
+	initVRegion(&_kernelSpace, VMM_KERNEL_SPACE_START, VMM_KERNEL_SPACE_END, kernelSpacePage);
 	interrupt_restore(eflags);
 }
\ No newline at end of file
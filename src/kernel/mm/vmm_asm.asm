@@ -1,6 +1,8 @@
 global set_cr3
 global paging_invalidate_pte
 global paging_get_cr3
+global paging_get_cr2
+global paging_flush_global
 
 section .text
 
@@ -23,4 +25,21 @@ section .text
 
     paging_get_cr3:
         mov eax, cr3
+        ret
+
+    ; paging_get_cr2 -- The address that caused the last page fault.
+    paging_get_cr2:
+        mov eax, cr2
+        ret
+
+    ; paging_flush_global -- Empty the TLB, global pages included.
+    ; A CR3 reload leaves the global pages there, turning CR4.PGE off and on again doesn't.
+    paging_flush_global:
+        mov eax, cr4
+        mov ecx, eax
+        and ecx, ~0x80
+        mov cr4, ecx
+        mov cr4, eax
+        mov eax, cr3
+        mov cr3, eax
         ret
\ No newline at end of file
@@ -0,0 +1,413 @@
+#include <mm/vregion.h>
+#include <mm/pmm.h>
+
+#include <debug_utils/printf.h>
+
+/**
+ * \brief Allocator of virtual address ranges.
+ * 
+ * The free ranges of virtual pages are kept in an AVL tree ordered by address, 
+ * and every node has the size of the biggest range below it.
+ * So the lowest free range that is big enough is found in O(log n), 
+ * going left when the left subtree has one and right otherwise, however much of the space is in use.
+ * 
+ * Freed ranges are merged with the ones right before and after them, so no two ranges in the tree are ever adjacent.
+ * The nodes come from a pool: the chunks inside the allocator, then pages of its own (see growVRegion()). Node 0 is never used.
+ */
+
+#define NIL 0       ///< No node
+
+#define NODE(r, n) ((r)->chunks[(n) / VREGION_CHUNK_NODES][(n) % VREGION_CHUNK_NODES])   ///< A node from its number
+
+uint32_t heightOfVRegion(vregion_t *r, uint32_t n) {
+    return n == NIL ? 0 : NODE(r, n).height;
+}
+
+uint32_t maxOfVRegion(vregion_t *r, uint32_t n) {
+    return n == NIL ? 0 : NODE(r, n).maxPages;
+}
+
+/**
+ * Recalculate height and biggest range of a node from its children.
+ */
+void updateVRegion(vregion_t *r, uint32_t n) {
+    vregion_node_t *node = &NODE(r, n);
+    uint32_t hl = heightOfVRegion(r, node->left), hr = heightOfVRegion(r, node->right);
+    uint32_t ml = maxOfVRegion(r, node->left), mr = maxOfVRegion(r, node->right);
+
+    node->height = 1 + (hl > hr ? hl : hr);
+    node->maxPages = node->pages;
+    if (ml > node->maxPages)
+        node->maxPages = ml;
+    if (mr > node->maxPages)
+        node->maxPages = mr;
+}
+
+uint32_t rotateRightVRegion(vregion_t *r, uint32_t n) {
+    uint32_t l = NODE(r, n).left;
+
+    NODE(r, n).left = NODE(r, l).right;
+    NODE(r, l).right = n;
+    updateVRegion(r, n);
+    updateVRegion(r, l);
+    return l;
+}
+
+uint32_t rotateLeftVRegion(vregion_t *r, uint32_t n) {
+    uint32_t rt = NODE(r, n).right;
+
+    NODE(r, n).right = NODE(r, rt).left;
+    NODE(r, rt).left = n;
+    updateVRegion(r, n);
+    updateVRegion(r, rt);
+    return rt;
+}
+
+/**
+ * Restore the AVL property of a node whose subtrees differ by at most 2 in height.
+ * 
+ * @return The new root of the subtree.
+ */
+uint32_t balanceVRegion(vregion_t *r, uint32_t n) {
+    vregion_node_t *node = &NODE(r, n);
+    updateVRegion(r, n);
+
+    if (heightOfVRegion(r, node->left) > heightOfVRegion(r, node->right) + 1) {
+        vregion_node_t *l = &NODE(r, node->left);
+        if (heightOfVRegion(r, l->right) > heightOfVRegion(r, l->left))
+            node->left = rotateLeftVRegion(r, node->left);
+        return rotateRightVRegion(r, n);
+    }
+    if (heightOfVRegion(r, node->right) > heightOfVRegion(r, node->left) + 1) {
+        vregion_node_t *rt = &NODE(r, node->right);
+        if (heightOfVRegion(r, rt->left) > heightOfVRegion(r, rt->right))
+            node->right = rotateRightVRegion(r, node->right);
+        return rotateLeftVRegion(r, n);
+    }
+    return n;
+}
+
+/**
+ * Insert a node in a subtree.
+ * 
+ * @return The new root of the subtree.
+ */
+uint32_t insertVRegion(vregion_t *r, uint32_t root, uint32_t n) {
+    if (root == NIL)
+        return n;
+
+    if (NODE(r, n).start < NODE(r, root).start)
+        NODE(r, root).left = insertVRegion(r, NODE(r, root).left, n);
+    else
+        NODE(r, root).right = insertVRegion(r, NODE(r, root).right, n);
+    return balanceVRegion(r, root);
+}
+
+/**
+ * Unlink the node with the lowest address of a subtree.
+ * 
+ * @param min Where to put the unlinked node.
+ * @return The new root of the subtree.
+ */
+uint32_t unlinkMinVRegion(vregion_t *r, uint32_t root, uint32_t *min) {
+    if (NODE(r, root).left == NIL) {
+        *min = root;
+        return NODE(r, root).right;
+    }
+
+    NODE(r, root).left = unlinkMinVRegion(r, NODE(r, root).left, min);
+    return balanceVRegion(r, root);
+}
+
+/**
+ * Unlink the node that starts at a page from a subtree.
+ * 
+ * @return The new root of the subtree.
+ */
+uint32_t unlinkVRegion(vregion_t *r, uint32_t root, uint32_t start) {
+    if (root == NIL)
+        return NIL;
+
+    vregion_node_t *node = &NODE(r, root);
+    if (node->start == start) {
+        if (node->right == NIL)
+            return node->left;
+
+        // The successor takes its place
+        uint32_t min;
+        uint32_t right = unlinkMinVRegion(r, node->right, &min);
+        NODE(r, min).left = node->left;
+        NODE(r, min).right = right;
+        return balanceVRegion(r, min);
+    }
+
+    if (start < node->start)
+        node->left = unlinkVRegion(r, node->left, start);
+    else
+        node->right = unlinkVRegion(r, node->right, start);
+    return balanceVRegion(r, root);
+}
+
+/**
+ * Recalculate the biggest ranges on the path to a node whose size changed 
+ * (its start can change too, as long as it stays between its neighbours).
+ */
+void refreshVRegion(vregion_t *r, uint32_t root, uint32_t n) {
+    if (root == NIL)
+        return;
+
+    if (root != n) {
+        if (NODE(r, n).start < NODE(r, root).start)
+            refreshVRegion(r, NODE(r, root).left, n);
+        else
+            refreshVRegion(r, NODE(r, root).right, n);
+    }
+    updateVRegion(r, root);
+}
+
+/**
+ * Put the nodes of a chunk in the pool.
+ */
+void addChunkVRegion(vregion_t *r, vregion_node_t *chunk) {
+    uint32_t first = r->nChunks * VREGION_CHUNK_NODES;
+    uint32_t i;
+
+    r->chunks[r->nChunks++] = chunk;
+    for (i = first; i < first + VREGION_CHUNK_NODES; i++) {
+        if (i == NIL)
+            continue;
+        NODE(r, i).left = (i + 1 < first + VREGION_CHUNK_NODES) ? i + 1 : r->pool;
+    }
+    r->pool = first == NIL ? first + 1 : first;
+}
+
+/**
+ * Get another chunk of nodes, from a page of its own (see newPage). 
+ * The page can come from the allocator itself: taking a range never needs a node, 
+ * and while it's growing, a range given back that would need one isn't (it's lost instead of looping).
+ * 
+ * @return If the pool has nodes now.
+ */
+bool growVRegion(vregion_t *r) {
+    if (!r->newPage || r->growing || r->nChunks == VREGION_CHUNKS)
+        return false;
+
+    r->growing = true;
+    vregion_node_t *chunk = r->newPage();
+    r->growing = false;
+    if (!chunk)
+        return false;
+
+    addChunkVRegion(r, chunk);
+    return true;
+}
+
+/**
+ * Add a free range to the tree, with a node from the pool.
+ * 
+ * @return If there was a free node.
+ */
+bool addVRegion(vregion_t *r, uint32_t start, uint32_t pages) {
+    if (r->pool == NIL && !growVRegion(r))
+        return false;
+
+    uint32_t n = r->pool;
+    r->pool = NODE(r, n).left;
+
+    NODE(r, n).start = start;
+    NODE(r, n).pages = pages;
+    NODE(r, n).left = NIL;
+    NODE(r, n).right = NIL;
+    updateVRegion(r, n);
+
+    r->root = insertVRegion(r, r->root, n);
+    return true;
+}
+
+/**
+ * Remove a free range from the tree and give its node back to the pool.
+ */
+void removeVRegion(vregion_t *r, uint32_t n) {
+    r->root = unlinkVRegion(r, r->root, NODE(r, n).start);
+    NODE(r, n).left = r->pool;
+    r->pool = n;
+}
+
+/**
+ * Find the free ranges right before and right after a page.
+ * 
+ * @param prev Range with the highest address below page (or NIL).
+ * @param next Range with the lowest address from page on (or NIL).
+ */
+void neighboursVRegion(vregion_t *r, uint32_t page, uint32_t *prev, uint32_t *next) {
+    uint32_t n = r->root;
+
+    *prev = NIL;
+    *next = NIL;
+    while (n != NIL) {
+        if (NODE(r, n).start < page) {
+            *prev = n;
+            n = NODE(r, n).right;
+        } else {
+            *next = n;
+            n = NODE(r, n).left;
+        }
+    }
+}
+
+/**
+ * Set up an allocator with every page of [start, end) free.
+ * 
+ * @param r The allocator.
+ * @param start First address it manages.
+ * @param end Address after the last one it manages.
+ * @param newPage Where to get a page for more nodes (null if VREGION_NODES free ranges are enough).
+ */
+void initVRegion(vregion_t *r, uint32_t start, uint32_t end, void *(*newPage)()) {
+    uint32_t i;
+
+    r->start = start / PAGE_SIZE;
+    r->end = end / PAGE_SIZE;
+    r->root = NIL;
+    r->newPage = newPage;
+    r->growing = false;
+
+    // Every node of the chunks inside is in the pool
+    r->pool = NIL;
+    r->nChunks = 0;
+    for (i = 0; i < VREGION_INLINE_CHUNKS; i++)
+        addChunkVRegion(r, &r->nodes[i * VREGION_CHUNK_NODES]);
+
+    if (r->end > r->start)
+        addVRegion(r, r->start, r->end - r->start);
+}
+
+/**
+ * Find a free range of pages (the lowest one big enough) and take it.
+ * 
+ * @param r The allocator.
+ * @param pages Number of pages.
+ * 
+ * @return The address of the first page, or 0 if there isn't a range that big.
+ */
+uint32_t allocVRegion(vregion_t *r, uint32_t pages) {
+    uint32_t n = r->root;
+
+    if (pages == 0 || maxOfVRegion(r, n) < pages)
+        return 0;
+
+    // Go left as long as there is something big enough there
+    while (1) {
+        vregion_node_t *node = &NODE(r, n);
+        if (maxOfVRegion(r, node->left) >= pages)
+            n = node->left;
+        else if (node->pages >= pages)
+            break;
+        else
+            n = node->right;
+    }
+
+    uint32_t start = NODE(r, n).start;
+    if (NODE(r, n).pages == pages)
+        removeVRegion(r, n);
+    else {
+        // Take the beginning, the rest stays where it is in the tree
+        NODE(r, n).start += pages;
+        NODE(r, n).pages -= pages;
+        refreshVRegion(r, r->root, n);
+    }
+
+    return start * PAGE_SIZE;
+}
+
+/**
+ * Take a range at a given address, for who needs that exact address.
+ * A range that is not inside the allocator isn't its business, so it's always fine.
+ * 
+ * @param r The allocator.
+ * @param addr Address of the first page.
+ * @param pages Number of pages.
+ * 
+ * @return If the range is now taken (false if part of it was already in use).
+ */
+bool reserveVRegion(vregion_t *r, uint32_t addr, uint32_t pages) {
+    uint32_t start = addr / PAGE_SIZE;
+    uint32_t end = start + pages;
+
+    if (pages == 0 || end <= r->start || start >= r->end)
+        return true;
+
+    // The range must be inside a single free one
+    uint32_t n, next;
+    neighboursVRegion(r, start + 1, &n, &next);
+    if (n == NIL || end > NODE(r, n).start + NODE(r, n).pages)
+        return false;
+
+    vregion_node_t *node = &NODE(r, n);
+    uint32_t nodeEnd = node->start + node->pages;
+
+    if (node->start == start && nodeEnd == end)
+        removeVRegion(r, n);
+    else if (node->start == start) {
+        node->start = end;
+        node->pages = nodeEnd - end;
+        refreshVRegion(r, r->root, n);
+    } else {
+        // Keep the part before, then add the part after (if any)
+        if (nodeEnd > end && r->pool == NIL && !growVRegion(r))
+            return false;
+
+        node->pages = start - node->start;
+        refreshVRegion(r, r->root, n);
+        if (nodeEnd > end)
+            addVRegion(r, end, nodeEnd - end);
+    }
+    return true;
+}
+
+/**
+ * Give back a range, merging it with the free ones right before and after it.
+ * 
+ * @param r The allocator.
+ * @param addr Address of the first page.
+ * @param pages Number of pages.
+ * 
+ * @return If everything's OK (false if part of it was already free or there are no free nodes left).
+ */
+bool freeVRegion(vregion_t *r, uint32_t addr, uint32_t pages) {
+    uint32_t start = addr / PAGE_SIZE;
+    uint32_t end = start + pages;
+
+    if (pages == 0 || end <= r->start || start >= r->end)
+        return true;
+
+    uint32_t prev, next;
+    neighboursVRegion(r, start, &prev, &next);
+
+    if ((prev != NIL && NODE(r, prev).start + NODE(r, prev).pages > start) ||
+        (next != NIL && NODE(r, next).start < end)) {
+        printf("VMM: freeing virtual 0x%x, which is already free\n", addr);
+        return false;
+    }
+
+    bool mergePrev = prev != NIL && NODE(r, prev).start + NODE(r, prev).pages == start;
+    bool mergeNext = next != NIL && NODE(r, next).start == end;
+
+    if (mergePrev && mergeNext) {
+        uint32_t nextPages = NODE(r, next).pages;
+        removeVRegion(r, next);
+        NODE(r, prev).pages += pages + nextPages;
+        refreshVRegion(r, r->root, prev);
+    } else if (mergePrev) {
+        NODE(r, prev).pages += pages;
+        refreshVRegion(r, r->root, prev);
+    } else if (mergeNext) {
+        NODE(r, next).start = start;
+        NODE(r, next).pages += pages;
+        refreshVRegion(r, r->root, next);
+    } else if (!addVRegion(r, start, pages)) {
+        printf("VMM: no room to free virtual 0x%x\n", addr);
+        return false;
+    }
+    return true;
+}
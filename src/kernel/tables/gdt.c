@@ -1,4 +1,7 @@
 #include <tables/gdt.h>
+#include <mm/vmm.h>
+
+#include <common/utility.h>
 
 /**
  * The Global Descriptor Table (GDT) is a data structure used by Intel x86-family processors starting with the 80286 
@@ -11,6 +14,10 @@
 gdt_entry_t gdt_entries[DESCRIPTORS];
 gdt_descriptor_t gdt_ptr;
 
+tss_t _tss;                 ///< The kernel's
+tss_t _doubleFaultTSS;      ///< The double fault handler's
+uint8_t _doubleFaultStack[DOUBLE_FAULT_STACK] __attribute__((aligned(16)));
+
 void init_gdt() {
     gdt_ptr.size = sizeof(gdt_entries) - 1;
     gdt_ptr.offset = (uint32_t)gdt_entries;
@@ -50,7 +57,37 @@ void init_gdt() {
     gdt_setEntry(3, 0, 0xFFFFFFFF, 0xFA, 0xCF);
     gdt_setEntry(4, 0, 0xFFFFFFFF, 0xF2, 0xCF);
 
+    /**
+     * The two TSS.
+     * Access = 0x89: present, ring 0, 32 bit available TSS. Byte granularity.
+     * 
+     * The double fault handler runs with the boot page directory (it maps the whole kernel image, that's all it needs), 
+     * with interrupts disabled and on its own stack, so a kernel stack that overflowed doesn't take it down too.
+     */
+    memset(&_tss, 0, sizeof(tss_t));
+    _tss.ss0 = 0x10;
+    _tss.iomap = sizeof(tss_t);
+
+    memset(&_doubleFaultTSS, 0, sizeof(tss_t));
+    _doubleFaultTSS.cr3 = paging_get_cr3();
+    _doubleFaultTSS.esp = (uint32_t)_doubleFaultStack + DOUBLE_FAULT_STACK;
+    _doubleFaultTSS.eflags = 0x2;
+    _doubleFaultTSS.cs = 0x08;
+    _doubleFaultTSS.ds = _doubleFaultTSS.es = _doubleFaultTSS.fs = _doubleFaultTSS.gs = _doubleFaultTSS.ss = 0x10;
+    _doubleFaultTSS.iomap = sizeof(tss_t);
+
+    gdt_setEntry(5, (uint32_t)&_tss, sizeof(tss_t) - 1, 0x89, 0x00);
+    gdt_setEntry(6, (uint32_t)&_doubleFaultTSS, sizeof(tss_t) - 1, 0x89, 0x00);
+
     gdt_load((uint32_t)&gdt_ptr);
+    tss_load(TSS_SELECTOR);
+}
+
+/**
+ * Set the function the double fault task starts from (it never returns).
+ */
+void gdt_setDoubleFault(void (*handler)()) {
+    _doubleFaultTSS.eip = (uint32_t)handler;
 }
 
 /** 
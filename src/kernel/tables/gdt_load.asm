@@ -17,3 +17,10 @@ reloadCS:
     mov ss, ax
 
     ret
+
+global tss_load
+tss_load:
+    ; Load the task register: where the CPU saves the kernel when switching to another task (the double fault handler)
+    mov ax, [esp + 4]
+    ltr ax
+    ret